@@ -35,12 +35,20 @@
 
 #include <stdlib.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdarg.h>
 #include <unistd.h>
 #include <math.h>
+#include <float.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <errno.h>
+#include <pthread.h>
 #include <arpa/inet.h>
 #include <ctype.h>
 
@@ -48,6 +56,13 @@
 #include "omp.h"
 #endif
 
+/* x86 SIMD kernels for the sample conversions, picked at run time.
+ */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define WITH_X86_SIMD
+#include <immintrin.h>
+#endif
+
 /* bool definitions.
  */
 #ifndef __cplusplus
@@ -68,12 +83,15 @@ void DisplayData_CheckZoomAndShift(bool adapt);
 #define my_max(a, b) ((a) > (b) ? (a) : (b))
 #define my_sgn(a) ((a) < 0 ? (-1) : ((a) > 0 ? (1) : (0)))
 
+void flush_output_on_error();
+
 void prerror_and_exit(const char *fmt, ...) {
 	va_list args;
 
 	va_start(args, fmt);
 	vfprintf(stderr, fmt, args);
 	va_end(args);
+	flush_output_on_error();
 	exit(-1);
 }
 
@@ -340,8 +358,29 @@ typedef struct {
 	SEGY_trace_header trace_header;
 	unsigned char *trace_data;
 	double *trace_data_double;
+	void (*decode_samples)(const unsigned char *src, double *dst, int n);
+	void (*encode_samples)(const double *src, unsigned char *dst, int n);
+	/* From the format of the input straight to the one of this file. */
+	void (*transcode_samples)(const unsigned char *src, unsigned char *dst,
+			int n);
+	bool keep; /* keep_trace() of the last trace header read. */
 	FILE *fp;
 	char *fname;
+
+	/* Memory mapped input, when map is NULL the stdio fp is used instead.
+	 * trace_data then points either into the map, to a prefetch slot or
+	 * to trace_buffer.
+	 */
+	unsigned char *map;
+	off_t map_size, map_pos;
+	off_t trace_pos; /* Offset of the last trace header read. */
+	bool at_eof; /* End of file found reading the map or the prefetch ring. */
+	unsigned char *trace_buffer;
+
+	/* Output buffer, written out with writev only when full or on close.
+	 */
+	unsigned char *out_buffer;
+	size_t out_buffer_len, out_buffer_size;
 } SEGY_file;
 
 /* PAPER SIZES for postscript plot.
@@ -359,10 +398,22 @@ bool only_traces_with, replace_ebcdic, plot_data, dump_fields, change_fields,
 		dump_header_fields, change_header_fields, shot_renumber, trace_renumber,
 		no_header, flip_endianess, add_xy, source_1_or_receiver_2,
 		print_rec_seq_num, dump_xy, use_names, scan, apply_correction,
-		no_EBCDIC_stamp, enable_X11;
-char *fields_to_dump, *fields_to_change_fname, *add_coordinates_fname,
-		*header_fields_to_change, *header_fields_to_dump,
-		*traces_fields_valid_values;
+		no_EBCDIC_stamp, enable_X11, use_mmap, build_index, header_only,
+		build_key_index;
+char *fields_to_change_fname, *add_coordinates_fname;
+
+/* A field of -dump_trace_fields, -dump_header_fields or
+ * -change_header_fields, parsed once from its offset:type[:value] string.
+ */
+typedef struct {
+	int offset;
+	char type;
+	int name_index; /* Into the names table with -use_names, -1 otherwise. */
+	char *text; /* The value as given, for -change_header_fields. */
+} FIELD_SPEC;
+
+FIELD_SPEC *trace_fields_dump, *header_fields_dump, *header_fields_change;
+int num_trace_fields_dump, num_header_fields_dump, num_header_fields_change;
 unsigned char convert_to = ' ', correction_op = '+';
 double correction_val;
 int _i, _j, _n, i, j, k, all_file, dump, count, vertical_stack;
@@ -370,6 +421,11 @@ int initial_record, initial_trace_seq, trace_offset, trace_start, trace_end,
 		rec_start, rec_end, output_segy, verbose, n_traces, n_samples, reccnt,
 		current_trace, processed_traces, skip_ntraces, only_ntraces,
 		skip_nsamples, only_nsamples, current_record, num_traces_per_cm, page_format;
+long out_buffer_mb;
+int prefetch_slots;
+bool prefetch_active;
+int build_xy_index; /* 1 source, 2 receiver, 0 none. */
+off_t prefetch_pos;
 off_t initial_seek;
 double trace_scale;
 double actual_row;
@@ -405,6 +461,72 @@ void swap4(unsigned int* x) {
 			| ((*x) << 24);
 }
 
+/* BULK BYTE SWAP of n values of size 2 or 4 bytes at p, in place.
+ */
+void swap_bytes_scalar(unsigned char *p, int n, int size) {
+	int i;
+
+	if (size == 2)
+		for (i = 0; i < n; i++)
+			swap2((unsigned short*) (p + i * 2));
+	else
+		for (i = 0; i < n; i++)
+			swap4((unsigned int*) (p + i * 4));
+}
+
+#ifdef WITH_X86_SIMD
+__attribute__((target("ssse3")))
+void swap_bytes_ssse3(unsigned char *p, int n, int size) {
+	int i, len = n * size;
+	const __m128i mask = size == 2 ?
+			_mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14) :
+			_mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		__m128i x = _mm_loadu_si128((__m128i *) (p + i));
+		_mm_storeu_si128((__m128i *) (p + i), _mm_shuffle_epi8(x, mask));
+	}
+	swap_bytes_scalar(p + i, (len - i) / size, size);
+}
+
+__attribute__((target("avx2")))
+void swap_bytes_avx2(unsigned char *p, int n, int size) {
+	int i, len = n * size;
+	const __m256i mask = size == 2 ?
+			_mm256_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15,
+					14, 1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14) :
+			_mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13,
+					12, 3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+
+	for (i = 0; i + 64 <= len; i += 64) {
+		__m256i x = _mm256_loadu_si256((__m256i *) (p + i));
+		__m256i y = _mm256_loadu_si256((__m256i *) (p + i + 32));
+		_mm256_storeu_si256((__m256i *) (p + i), _mm256_shuffle_epi8(x, mask));
+		_mm256_storeu_si256((__m256i *) (p + i + 32),
+				_mm256_shuffle_epi8(y, mask));
+	}
+	swap_bytes_ssse3(p + i, (len - i) / size, size);
+}
+#endif
+
+void (*swap_bytes_kernel)(unsigned char *p, int n, int size);
+
+/* Pick the fastest byte swap kernel this CPU can run.
+ */
+void select_swap_bytes_kernel() {
+	swap_bytes_kernel = swap_bytes_scalar;
+#ifdef WITH_X86_SIMD
+	if (__builtin_cpu_supports("avx2"))
+		swap_bytes_kernel = swap_bytes_avx2;
+	else if (__builtin_cpu_supports("ssse3"))
+		swap_bytes_kernel = swap_bytes_ssse3;
+#endif
+}
+
+void swap_bytes(void *p, int n, int size) {
+	swap_bytes_kernel((unsigned char *) p, n, size);
+}
+
 /* return the parameter index given its name or -1 if wrong name.
  */
 int get_parameter_index_by_name(char **names, char *name) {
@@ -425,7 +547,7 @@ int get_parameter_index_by_name(char **names, char *name) {
 
 int get_parameter_index_by_offset(int *header_types, int offset) {
 	int r = 0;
-	while (header_types[r * 2] != offset) {
+	while (header_types[r * 2] != offset && header_types[r * 2] != -1) {
 		r++;
 	}
 	if (header_types[r * 2] != -1)
@@ -441,7 +563,6 @@ int get_parameter_index_by_offset(int *header_types, int offset) {
  */
 char my_header_fields_offsets[2048];
 char my_traces_fields_offsets[2048];
-char my_valid_traces_fields_offsets[2048];
 void from_names_to_offsets(char **names, char *my_names, char *my_offsets) {
 	char n[2048];
 	int j = 0, c = 0;
@@ -487,6 +608,39 @@ void from_names_to_offsets(char **names, char *my_names, char *my_offsets) {
 	}
 }
 
+/* Parse a comma separated list of offset:type[:value] fields into an
+ * array of FIELD_SPEC, header_types gives the names with -use_names and
+ * header_size the size of the header the offsets point into.
+ * RETURN: THE NUMBER OF FIELDS.
+ */
+int compile_field_specs(char *str, int *header_types, int header_size,
+		FIELD_SPEC **specs) {
+	char m_field[1000], m_fields[1000];
+	int m_field_nr = 1, n = 0;
+
+	*specs = NULL;
+	while (get_field(str, m_field_nr, m_fields, ',')) {
+		*specs = (FIELD_SPEC *) realloc(*specs, (n + 1) * sizeof(FIELD_SPEC));
+		if (*specs == NULL)
+			prerror_and_exit("Error: Cannot allocate memory for the fields.\n");
+		FIELD_SPEC *f = *specs + n++;
+		get_field(m_fields, 1, m_field, ':');
+		f->offset = atoi(m_field);
+		get_field(m_fields, 2, m_field, ':');
+		f->type = m_field[0];
+		if (f->offset < 0
+				|| f->offset + (f->type == 'S' ? 2 : 4) > header_size)
+			prerror_and_exit("FATAL ERROR: field offset %d out of the header.\n",
+					f->offset);
+		f->name_index = use_names ?
+				get_parameter_index_by_offset(header_types, f->offset) : -1;
+		get_field(m_fields, 3, m_field, ':');
+		f->text = strdup(m_field);
+		m_field_nr++;
+	}
+	return n;
+}
+
 int is_little_endian() {
 	int a;
 	char *b;
@@ -581,30 +735,62 @@ void set_ieee(float value, void *idx) {
 	//printf("%lf==%lf, ", value, get_ieee(idx));
 }
 
-void set_ibm(double value, void *idx) {
-	int v, mantissa, tmp;
-	float *fint;
-	fint = (float*) &v;
-	*fint = (float) value;
+/* Convert the bits of an IEEE 754 float to the bits of an IBM float, in
+ * host order, rounding the fraction to nearest even. Zero keeps its sign,
+ * denormals are normalised first, infinity becomes the largest IBM value
+ * and NaN zero.
+ */
+unsigned int ieee_to_ibm_bits(unsigned int v) {
+	unsigned int sign = v & 0x80000000, mantissa, rem, half;
+	int tmp, shift;
+
+	v &= 0x7fffffff;
+	if (v == 0)
+		return sign;
+	if (v > 0x7f800000)
+		return 0;
+	if (v == 0x7f800000)
+		return sign | 0x7fffffff;
+
+	if (v < 0x00800000) { /* Denormal, scale it up by 2^24. */
+		float f;
+		memcpy(&f, &v, 4);
+		f *= 16777216.0f;
+		memcpy(&v, &f, 4);
+		tmp = -24;
+	} else
+		tmp = 0;
+
+	mantissa = (0x007fffff & v) | 0x00800000;
+	tmp += (int) (v >> 23) - 126;
 
-	if (v != 0) {
-		mantissa = (0x007fffff & v) | 0x00800000;
-		tmp = ((0x7f800000 & v) >> 23) - 126;
-		while (tmp & 0x3) {
-			mantissa = mantissa >> 1;
-			tmp++;
+	/* The IBM exponent is a power of 16, drop 0 to 3 bits of the
+	 * mantissa to get there and round on them.
+	 */
+	shift = -tmp & 0x3;
+	if (shift) {
+		half = 1 << (shift - 1);
+		rem = mantissa & ((1 << shift) - 1);
+		mantissa >>= shift;
+		if (rem > half || (rem == half && (mantissa & 1)))
+			mantissa++;
+		if (mantissa == 0x01000000) {
+			mantissa = 0x00100000;
+			tmp += 4;
 		}
-		v = (0x80000000 & v) | (((tmp >> 2) + 64) << 24) | mantissa;
 	}
+	tmp += shift;
 
-	unsigned char *bytes = (unsigned char *) idx;
+	return sign | (((tmp >> 2) + 64) << 24) | mantissa;
+}
 
-	bytes[0] = v >> 24;
-	bytes[1] = ((v & 0xff0000) >> 16);
-	bytes[2] = ((v & 0xff00) >> 8);
-	bytes[3] = (v & 0xff);
+void set_ibm(double value, void *idx) {
+	float f = (float) value;
+	uint32_t v;
 
-	return;
+	memcpy(&v, &f, 4);
+	v = htonl(ieee_to_ibm_bits(v));
+	memcpy(idx, &v, 4);
 }
 
 /* Given the trace header and a type, return the string
@@ -738,6 +924,17 @@ void print_usage(int argc, char **argv) {
 					" Input & output:\n"
 					"   -f input_file         : The input file (use \"-\" for stdin)\n"
 					"   -o output_file        : The output file (use \"-\" for stdout)\n"
+					"   -in_place             : Write the changed bytes of the SEGY header and of\n"
+					"                           the trace headers back into the input file instead\n"
+					"                           of copying it to a new output, the trace data is\n"
+					"                           never rewritten. Only header changes are allowed,\n"
+					"                           ie -change_header_fields, -change_trace_fields,\n"
+					"                           -update_trace_fields, -irc, -itc, -add_xy and\n"
+					"                           -add_nav; traces not selected are left unchanged.\n"
+					"   -journal fname        : With -in_place, save the original bytes of every\n"
+					"                           change to fname before making it.\n"
+					"   -undo_journal fname   : Write back into the file given with -f the original\n"
+					"                           bytes saved by -journal, then exit.\n"
 					"\n"
 					" Switches:\n"
 					"   -flip_endianess       : Flip endianess, useful to make\n"
@@ -756,10 +953,35 @@ void print_usage(int argc, char **argv) {
 					"                           To know at which offsets a field is stored\n"
 					"                           or which parameters are available, use the\n"
 					"                           '-segy_info and -use_names switches.'\n"
+					"   -export_trace_fields  : Export trace header fields of the kept traces as\n"
+					"    dir,field0,field1,...  binary columns, one file per field named after it\n"
+					"                           in the directory dir, holding a little endian\n"
+					"                           int16, int32 or float32 array by the field type,\n"
+					"                           with dir/manifest.json listing the number of\n"
+					"                           traces and the offset, dtype and file of each\n"
+					"                           field. Fields are parameter names or offset:type,\n"
+					"                           ie: -export_trace_fields cols,CDP_NUMBER,72:I\n"
+					"                           writes cols/CDP_NUMBER.bin and cols/72_I.bin.\n"
 					"   -change_trace_fields  : Change trace header fields given a file with values.\n"
 					"                           The file must be in the same format as the output\n"
 					"                           obtained by the -dump_trace_fields switch,\n"
 					"                           with or without the -use_names switch.\n"
+					"   -update_trace_fields  : Change trace header fields given a table of values\n"
+					"    fname                  keyed on record, sequence and trace number of the\n"
+					"                           input file, its rows may come in any order and\n"
+					"                           traces without a row are left unchanged. The text\n"
+					"                           table is comma separated, the first line names the\n"
+					"                           fields as parameter names or offset:type, ie:\n"
+					"                           record,sequence,trace,CDP_NUMBER,196:S\n"
+					"                           2504,1,1,1000,\n"
+					"                           2510,7,1,1006,12\n"
+					"                           an empty cell leaves that field unchanged. The\n"
+					"                           binary table is made of the 8 bytes SEGYTUB1, the\n"
+					"                           int32 number of fields, int32 offset and int32\n"
+					"                           type ('S', 'I' or 'F') of each field, then records\n"
+					"                           of int32 record, sequence, trace and a float64 per\n"
+					"                           field (NaN to leave it unchanged), all big endian.\n"
+					"                           A value out of the range of its field is an error.\n"
 					"   -dump_xy              : Print x and y location to stdout.\n"
 					"    SOURCE|RECEIVER        the word SOURCE or RECEIVER must be given, according\n"
 					"                           to locations to print.\n"
@@ -787,6 +1009,35 @@ void print_usage(int argc, char **argv) {
 					"                           segy-change -print_rec_seq_num -all -f segyfile\n"
 					"                           you can then just add coordinates and the unit of\n"
 					"                           measure in the proper format for each line.\n"
+					"                           The z elevation and the unit may be omitted, when\n"
+					"                           given z goes to the source or receiver elevation.\n"
+					"                           The file may also be in the binary format written\n"
+					"                           by -save_xy, which is much faster to load.\n"
+					"   -save_xy fname        : Save the coordinates read by -add_xy to fname in\n"
+					"                           binary format: the 8 bytes SEGYXYB1 followed by 40\n"
+					"                           bytes big endian records of int32 record, sequence,\n"
+					"                           trace, unit (0 unset, 1 feet or meters, 2 arcsec),\n"
+					"                           float64 x, y, z (NaN when missing).\n"
+					"   -add_nav              : Add coordinates to trace header interpolating them\n"
+					"    fname,SOURCE|RECEIVER  from a navigation file, one line per position. With\n"
+					"    ,TIME|RECORD           TIME each line holds\n"
+					"                           year day_of_year hour minute second x y unit\n"
+					"                           and positions are interpolated at the time found in\n"
+					"                           the trace header; with RECORD each line holds\n"
+					"                           original_field_record_number x y unit\n"
+					"                           and all the traces of a record get its position.\n"
+					"                           Lines need not be sorted, unit is meters, feet or\n"
+					"                           arcsec (meters when missing), a malformed line is\n"
+					"                           an error. Traces outside the navigation are left\n"
+					"                           unchanged.\n"
+					"                           Cannot be used together with -add_xy, ie:\n"
+					"                           awk '{lon=$2; if($3 == \"W\") lon=-lon;\n"
+					"                                 lat=$4; if($5 == \"S\") lat=-lat;\n"
+					"                                 printf(\"%%d %%lf %%lf arcsec\\n\", $1,\n"
+					"                                        lon * 3600, lat * 3600);}'\n"
+					"                                 6_channel.nav > nav.txt\n"
+					"                           segy-change -f 6_channel.seg -add_nav\n"
+					"                                 nav.txt,SOURCE,RECORD -o out.seg\n"
 					"   -do_op   +|-|*|/:VAL  : Do the given operation, for example to multiply all\n"
 					"                           trace values by 3.0 use: -do_op *:3.0\n"
 					"   -convert S|I|F|E      : Convert the trace encoding to the given format, where\n"
@@ -805,7 +1056,26 @@ void print_usage(int argc, char **argv) {
 					"                           trace_sequence_within_line and\n"
 					"                           trace_sequence_within_field_record terna.\n"
 					"   -scan                 : Scan SEGY and print some info.\n"
-					"   -dump                 : Dump traces values to stdout.\n"
+					"   -qc fname[,clip]      : Write to fname (\"-\" for stdout) a QC report with,\n"
+					"                           for every trace ('T' lines), record ('R' lines)\n"
+					"                           and for the whole file ('A' line): number of\n"
+					"                           samples, min, max, mean and RMS of the finite\n"
+					"                           samples, number of zero, NaN or infinite and\n"
+					"                           clipped samples. Clipped samples reach clip in\n"
+					"                           magnitude, by default the full scale of 16 and\n"
+					"                           32 bit integer formats.\n"
+					"   -dump                 : Dump traces values to stdout, as text with the\n"
+					"                           shortest decimal that reads back as each value.\n"
+					"   -dump_format          : Dump traces values, implies -dump, in the given\n"
+					"    fmt[,fname]            format to fname, by default to stdout, where fmt:\n"
+					"                           TEXT: the text of -dump\n"
+					"                           F32: raw little endian float32 samples\n"
+					"                           NPY: a NumPy .npy array of traces by samples, all\n"
+					"                                traces must have the same length and fname\n"
+					"                                cannot be a pipe\n"
+					"                           FRAMED: for each trace little endian int32 record,\n"
+					"                                sequence, trace number and number of samples\n"
+					"                                followed by the float32 samples.\n"
 					"   -dump_header_fields   : Dump header fields stored into the traces header.\n"
 					"                           Use it with the following syntax:\n"
 					"                           field_offset0:field_type0,offset1:type1,...\n"
@@ -825,13 +1095,19 @@ void print_usage(int argc, char **argv) {
 					"                           To know at which offsets a field is stored\n"
 					"                           or which parameters are available, use the\n"
 					"                           '-segy_info and -use_names switches.'\n"
-					"   -only_traces_with     : Keep only traces with fields from trace header\n"
-					"                           with a given value\n"
-					"                           syntax is field_offset0:field_type0:value,...\n"
+					"   -only_traces_with     : Keep only traces whose trace header fields satisfy\n"
+					"                           the given condition, with the syntax\n"
+					"                           field_offset0:field_type0:value,...\n"
 					"                           where type can be S for short (2 bytes),\n"
-					"                           I for int (4 bytes)\n"
+					"                           I for int (4 bytes), F for IEEE float\n"
 					"                           or\n"
 					"                           parameter0_name:value,parameter1_name:value,...\n"
+					"                           A field can be tested with = (or :), !=, <, <=,\n"
+					"                           > and >=, = and != take a value, a range lo..hi\n"
+					"                           or a set {v0,lo1..hi1,...}. 'field%%n' tests the\n"
+					"                           field modulo n. Tests are combined with 'and'\n"
+					"                           (or ','), 'or', 'not' and parentheses, ie:\n"
+					"                           '20:I%%4=0 and not 36:I={-100..100}'\n"
 					"                           To know at which offsets a field is stored\n"
 					"                           or which parameters are available, use the\n"
 					"                           '-segy_info and -use_names switches.'\n"
@@ -871,6 +1147,53 @@ void print_usage(int argc, char **argv) {
 					"                           use -change_trace_fields switch.\n"
 					"   -v     num            : Verbosity level: 1 | 2 | 3\n"
 					"   -x     num            : Skip num bytes at the beginning of input file.\n"
+					"   -no_mmap              : Read the input file with stdio instead of mapping\n"
+					"                           it in memory (stdin is never mapped).\n"
+					"   -build_index          : Write a trace index next to the input file, named\n"
+					"                           input_file.idx, holding offset, record number,\n"
+					"                           trace number, sequence number and number of\n"
+					"                           samples of every trace. When the index is there\n"
+					"                           and up to date, '-record' and '-trace' read only\n"
+					"                           the selected traces instead of the whole file.\n"
+					"   -build_key_index keys : Write a key index next to the input file, named\n"
+					"                           input_file.kidx, holding the offset of every\n"
+					"                           trace sorted by up to 4 trace header fields,\n"
+					"                           given by name or as offset:type, for example\n"
+					"                           'CDP_NUMBER,36:I' for CDP and offset.\n"
+					"   -key_range min,max[,min,max...]\n"
+					"                         : With an up to date key index, read only the\n"
+					"                           traces whose first key is in [min,max] (and the\n"
+					"                           second key in the second interval, ...), in key\n"
+					"                           order, e.g. to extract or view CDP gathers from\n"
+					"                           shot sorted data.\n"
+					"   -build_xy_index SOURCE|RECEIVER\n"
+					"                         : Write an xy index next to the input file, named\n"
+					"                           input_file.sxy (sources) or input_file.rxy\n"
+					"                           (receivers), holding the position of every\n"
+					"                           trace, scaled by the scalar at byte 70, in a\n"
+					"                           uniform grid of cells.\n"
+					"   -xy_box SOURCE|RECEIVER,xmin,ymin,xmax,ymax\n"
+					"                         : With an up to date xy index, read only the\n"
+					"                           traces whose source or receiver is inside the\n"
+					"                           box, in file order.\n"
+					"   -xy_polygon SOURCE|RECEIVER,x1,y1,x2,y2,x3,y3[,...]\n"
+					"                         : As -xy_box, for the traces inside the polygon\n"
+					"                           of the given vertices, e.g. around a well.\n"
+					"   -threads num          : Use num threads to make the output traces\n"
+					"                           (format conversion, -do_op, -vertical_stack),\n"
+					"                           traces are still written in input order.\n"
+					"                           With -scan, a file whose traces all have the\n"
+					"                           number of samples of the SEGY header is split\n"
+					"                           in chunks scanned in parallel. In the same way,\n"
+					"                           when such a file is only converted (-convert,\n"
+					"                           -flip_endianess, -do_op) into a regular output\n"
+					"                           file, each chunk is read, converted and written\n"
+					"                           at its own place in the output by its thread.\n"
+					"   -prefetch num         : Read the input in a separate thread, keeping up to\n"
+					"                           num traces ready ahead of their processing.\n"
+					"                           The input file is not memory mapped.\n"
+					"   -out_buffer num       : Size in MB of the output buffer (default 64),\n"
+					"                           0 writes every trace as soon as it is ready.\n"
 					"   -view                 : Display segy data.\n"
 					"\n\n"
 					" Examples:\n\n"
@@ -891,6 +1214,10 @@ void print_usage(int argc, char **argv) {
 					"\n"
 					"   segy-change -f in.segy -all -o out.segy -use_names\n"
 					"               -only_traces_with NUMBER_OF_SAMPLES_IN_THIS_TRACE:10000\n"
+					" - To extract every fourth CDP between 1000 and 2000:\n"
+					"\n"
+					"   segy-change -f in.segy -o out.segy -use_names\n"
+					"               -only_traces_with 'CDP_NUMBER=1000..2000 and CDP_NUMBER%%4=0'\n"
 					" - To make a postscript plot of the first two shot-gather, with 25 traces\n"
 			        "   per cm:\n"
 					"\n"
@@ -955,81 +1282,430 @@ void get_receiver_xy(SEGY_file *file, double *x, double *y,
 	*y = GET_SEGYTRACEH_Receiver_y_or_lat(header) * mult_scalar;
 }
 
-int coordinates_scaling_factor;
-
-void read_xy(char *fname) {
-	num_coords = 0;
-	max_x = max_y = -1e100;
-	min_x = min_y = 1e100;
+/* Hash index on record, sequence and trace number, an open addressing
+ * table of indexes into an array of entries starting with those three
+ * ints, -1 when empty. When a key is repeated the last entry wins.
+ */
+typedef struct {
+	int *slots;
+	unsigned long mask;
+	const char *base;
+	size_t stride;
+} TRACE_KEY_INDEX;
+
+TRACE_KEY_INDEX coords_index;
+
+unsigned long trace_key_hash(long rec, long seq, long num) {
+	unsigned long h = (unsigned long) rec * 0x9E3779B97F4A7C15UL;
+	h ^= (unsigned long) seq * 0xC2B2AE3D27D4EB4FUL + (h >> 29);
+	h ^= (unsigned long) num * 0x165667B19E3779F9UL + (h >> 32);
+	return h ^ (h >> 31);
+}
 
-	FILE *fp = fopen(fname, "r");
-	if (fp == NULL)
-		prerror_and_exit("Cannot open '%s' file, aborting.\n", fname);
+bool trace_key_match(TRACE_KEY_INDEX *idx, int i, long rec, long seq,
+		long num) {
+	const int *k = (const int *) (idx->base + i * idx->stride);
+	return rec == k[0] && seq == k[1] && num == k[2];
+}
 
-	int _idum;
-	double _fdum;
-	char tmp_c[1024000];
+void build_trace_key_index(TRACE_KEY_INDEX *idx, const void *base, int n,
+		size_t stride) {
+	unsigned long size = 16, h;
+	int i;
 
-	/* Find out how many records we have.
-	 */
-	while (!feof(fp)) {
-		fscanf(fp, "%d %d %d %lf %lf %s", &_idum, &_idum, &_idum, &_fdum,
-				&_fdum, tmp_c);
-		num_coords++;
+	while (size < 2 * (unsigned long) n)
+		size *= 2;
+	idx->slots = (int *) malloc(size * sizeof(int));
+	if (idx->slots == NULL)
+		prerror_and_exit("Error: Cannot allocate memory for the trace index.\n");
+	memset(idx->slots, -1, size * sizeof(int));
+	idx->mask = size - 1;
+	idx->base = (const char *) base;
+	idx->stride = stride;
+
+	for (i = 0; i < n; i++) {
+		const int *k = (const int *) (idx->base + i * stride);
+		h = trace_key_hash(k[0], k[1], k[2]) & idx->mask;
+		while (idx->slots[h] != -1
+				&& !trace_key_match(idx, idx->slots[h], k[0], k[1], k[2]))
+			h = (h + 1) & idx->mask;
+		idx->slots[h] = i;
 	}
+}
 
-	// Rewind the file and allocate the needed memory
-	rewind(fp);
-	coords = (COORDS*) calloc(sizeof(COORDS), num_coords + 1);
-
-	/* Read the actual data, and find the max and min in order to properly scale
-	 * the numbers.
-	 */
-	num_coords = 0;
-	while (!feof(fp)) {
-		fscanf(fp, "%d %d %d %lf %lf %s",
-				&(coords[num_coords].original_field_record),
-				&(coords[num_coords].trace_seq_within_reel),
-				&(coords[num_coords].trace_seq_within_field_record),
-				&(coords[num_coords].lon_or_x), &(coords[num_coords].lat_or_y),
-				tmp_c);
-
-		if (strcmp(tmp_c, "feet") == 0 || strcmp(tmp_c, "meters") == 0)
-			coords[num_coords].unit_of_measure_1_feet_or_meters_2_arcsec = 1;
-		if (strcmp(tmp_c, "arcsec") == 0)
-			coords[num_coords].unit_of_measure_1_feet_or_meters_2_arcsec = 2;
-
-		max_x = my_max(max_x, coords[num_coords].lon_or_x);
-		max_y = my_max(max_y, coords[num_coords].lat_or_y);
-		min_x = my_min(min_x, coords[num_coords].lon_or_x);
-		min_y = my_min(min_y, coords[num_coords].lat_or_y);
-		num_coords++;
+/* RETURN: THE INDEX OF THE ENTRY OF THE GIVEN TRACE, -1 IF NOT FOUND.
+ */
+int find_trace_key(TRACE_KEY_INDEX *idx, long rec, long seq, long num) {
+	unsigned long h = trace_key_hash(rec, seq, num) & idx->mask;
+	while (idx->slots[h] != -1) {
+		if (trace_key_match(idx, idx->slots[h], rec, seq, num))
+			return idx->slots[h];
+		h = (h + 1) & idx->mask;
 	}
+	return -1;
+}
 
-	double _max = my_max(fabs(my_max(max_x, max_y)),
-			fabs(my_min(min_x, min_y)));
+int coordinates_scaling_factor, elevation_scaling_factor;
+
+/* Pick the scalar that makes values up to _max in magnitude fit the
+ * integer fields of the trace header.
+ */
+int scalar_for_magnitude(double _max) {
 	double scaling = 2147483647.0 / _max;
+	int scalar = 0;
 	if (scaling > 0.0001)
-		coordinates_scaling_factor = 10000;
+		scalar = 10000;
 	if (scaling > 0.001)
-		coordinates_scaling_factor = 1000;
+		scalar = 1000;
 	if (scaling > 0.01)
-		coordinates_scaling_factor = 100;
+		scalar = 100;
 	if (scaling > 0.1)
-		coordinates_scaling_factor = 10;
+		scalar = 10;
 	if (scaling > 1)
-		coordinates_scaling_factor = 1;
+		scalar = 1;
 	if (scaling > 10)
-		coordinates_scaling_factor = -10;
+		scalar = -10;
 	if (scaling > 100)
-		coordinates_scaling_factor = -100;
+		scalar = -100;
 	if (scaling > 1000)
-		coordinates_scaling_factor = -1000;
+		scalar = -1000;
 	if (scaling > 10000)
-		coordinates_scaling_factor = -10000;
+		scalar = -10000;
+	return scalar;
+}
+
+/* The value of a header scalar, values are divided by it before being
+ * stored.
+ */
+double scalar_divisor(int scalar) {
+	if (scalar < 0)
+		return -1.0 / scalar;
+	return scalar;
+}
+
+/* COORDINATES FILE PARSING.
+ * The text file is read in a single pass through a buffer that grows
+ * to hold the longest line, numbers are parsed by hand since fscanf is
+ * far too slow on big navigation files. Each line holds
+ *   record sequence trace x y [z] [unit]
+ * The binary file starts with COORDS_BINARY_MAGIC followed by 40 bytes
+ * big endian records:
+ *   int32 record, sequence, trace, unit (0 unset, 1 feet or meters,
+ *   2 arcsec), float64 x, y, z (NaN when not given).
+ */
+#define COORDS_BINARY_MAGIC "SEGYXYB1"
+#define COORDS_BINARY_RECORD 40
+
+char *save_coordinates_fname;
+
+static const double pow10_table[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6,
+		1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18,
+		1e19, 1e20, 1e21, 1e22 };
+
+char *skip_blanks(char *p) {
+	while (*p == ' ' || *p == '\t' || *p == '\r')
+		p++;
+	return p;
+}
+
+/* Parse a decimal number at p, exactly when mantissa and exponent are
+ * small enough, with strtod otherwise.
+ * RETURN: THE FIRST CHARACTER AFTER THE NUMBER, NULL IF THERE IS NONE.
+ */
+char *parse_double(char *p, double *value) {
+	char *start = p;
+	uint64_t mant = 0;
+	int digits = 0, exp10 = 0, neg = 0;
+
+	if (*p == '-' || *p == '+')
+		neg = *p++ == '-';
+	for (; isdigit((unsigned char) *p); p++, digits++)
+		if (mant < 100000000000000000UL)
+			mant = mant * 10 + (*p - '0');
+		else
+			exp10++;
+	if (*p == '.')
+		for (p++; isdigit((unsigned char) *p); p++, digits++)
+			if (mant < 100000000000000000UL) {
+				mant = mant * 10 + (*p - '0');
+				exp10--;
+			}
+	if (digits == 0)
+		return NULL;
+	if (*p == 'e' || *p == 'E') {
+		char *q = p + 1;
+		int eneg = 0, e = 0;
+		if (*q == '-' || *q == '+')
+			eneg = *q++ == '-';
+		if (isdigit((unsigned char) *q)) {
+			for (; isdigit((unsigned char) *q); q++)
+				if (e < 10000)
+					e = e * 10 + (*q - '0');
+			exp10 += eneg ? -e : e;
+			p = q;
+		}
+	}
+	if (mant < (1UL << 53) && exp10 >= -22 && exp10 <= 22) {
+		*value = exp10 < 0 ? mant / pow10_table[-exp10] :
+				mant * pow10_table[exp10];
+		if (neg)
+			*value = -*value;
+	} else
+		*value = strtod(start, NULL);
+	return p;
+}
+
+/* RETURN: THE FIRST CHARACTER AFTER THE INTEGER, NULL IF THERE IS NONE.
+ */
+char *parse_long(char *p, long *value) {
+	long v = 0;
+	int neg = 0;
+	char *start;
+
+	if (*p == '-' || *p == '+')
+		neg = *p++ == '-';
+	for (start = p; isdigit((unsigned char) *p); p++)
+		v = v * 10 + (*p - '0');
+	if (p == start)
+		return NULL;
+	*value = neg ? -v : v;
+	return p;
+}
+
+bool end_of_token(char *p) {
+	return *p == ' ' || *p == '\t' || *p == '\r' || *p == '\n' || *p == 0;
+}
+
+/* Parse one line of the coordinates text file into c.
+ * RETURN: 1 ON SUCCESS, 0 FOR AN EMPTY LINE, -1 FOR A MALFORMED ONE.
+ */
+int parse_coords_line(char *p, COORDS *c) {
+	long l[3];
+	double d[3];
+	int i, nd;
+
+	p = skip_blanks(p);
+	if (*p == '\n' || *p == 0)
+		return 0;
+	for (i = 0; i < 3; i++) {
+		p = parse_long(skip_blanks(p), l + i);
+		if (p == NULL || !end_of_token(p))
+			return -1;
+	}
+	for (nd = 0; nd < 3; nd++) {
+		char *q = parse_double(skip_blanks(p), d + nd);
+		if (q == NULL || !end_of_token(q))
+			break;
+		p = q;
+	}
+	if (nd < 2)
+		return -1;
+
+	memset(c, 0, sizeof(COORDS));
+	c->original_field_record = l[0];
+	c->trace_seq_within_reel = l[1];
+	c->trace_seq_within_field_record = l[2];
+	c->lon_or_x = d[0];
+	c->lat_or_y = d[1];
+	c->elevation = nd == 3 ? d[2] : NAN;
+
+	p = skip_blanks(p);
+	char *unit = p;
+	while (!end_of_token(p))
+		p++;
+	if ((p - unit == 4 && strncmp(unit, "feet", 4) == 0)
+			|| (p - unit == 6 && strncmp(unit, "meters", 6) == 0))
+		c->unit_of_measure_1_feet_or_meters_2_arcsec = 1;
+	if (p - unit == 6 && strncmp(unit, "arcsec", 6) == 0)
+		c->unit_of_measure_1_feet_or_meters_2_arcsec = 2;
+	return 1;
+}
+
+void add_coords(COORDS *c, int *size) {
+	if (num_coords == *size) {
+		*size = *size ? *size * 2 : 65536;
+		coords = (COORDS *) realloc(coords, *size * sizeof(COORDS));
+		if (coords == NULL)
+			prerror_and_exit("Error: Cannot allocate memory for the coordinates.\n");
+	}
+	coords[num_coords++] = *c;
+}
+
+double get_double8(unsigned char *p) {
+	uint64_t u = 0;
+	double d;
+	int i;
+	for (i = 0; i < 8; i++)
+		u = (u << 8) | p[i];
+	memcpy(&d, &u, sizeof(d));
+	return d;
+}
+
+void set_double8(double d, unsigned char *p) {
+	uint64_t u;
+	int i;
+	memcpy(&u, &d, sizeof(u));
+	for (i = 7; i >= 0; i--, u >>= 8)
+		p[i] = u & 0xff;
+}
+
+void read_xy_binary(FILE *fp, char *fname) {
+	unsigned char rec[COORDS_BINARY_RECORD * 1024];
+	int size = 0;
+	size_t n, i;
+
+	/* Read bytes rather than records so that a partial record at the end
+	 * is seen, fread only stops short at the end of the file.
+	 */
+	while ((n = fread(rec, 1, sizeof(rec), fp)) > 0) {
+		if (n % COORDS_BINARY_RECORD != 0)
+			prerror_and_exit("'%s' file is truncated, aborting.\n", fname);
+		for (i = 0; i < n / COORDS_BINARY_RECORD; i++) {
+			unsigned char *r = rec + i * COORDS_BINARY_RECORD;
+			COORDS c;
+			memset(&c, 0, sizeof(COORDS));
+			c.original_field_record = get_int(r);
+			c.trace_seq_within_reel = get_int(r + 4);
+			c.trace_seq_within_field_record = get_int(r + 8);
+			c.unit_of_measure_1_feet_or_meters_2_arcsec = get_int(r + 12);
+			c.lon_or_x = get_double8(r + 16);
+			c.lat_or_y = get_double8(r + 24);
+			c.elevation = get_double8(r + 32);
+			add_coords(&c, &size);
+		}
+	}
+	if (ferror(fp))
+		prerror_and_exit("Error reading '%s' file, aborting.\n", fname);
+}
+
+/* Call parse_line on every line of the text file, in a single pass
+ * through a buffer that grows to hold the longest line. parse_line
+ * returns a negative value for a malformed line.
+ */
+void read_text_lines(FILE *fp, char *fname,
+		int (*parse_line)(char *line, void *ctx), void *ctx) {
+	size_t buf_size = 1 << 20, len = 0, n;
+	char *buf = (char *) malloc(buf_size + 1);
+	long line_nr = 0;
+
+	if (buf == NULL)
+		prerror_and_exit("Error: Cannot allocate memory to read '%s'.\n", fname);
+	do {
+		n = fread(buf + len, 1, buf_size - len, fp);
+		len += n;
+		buf[len] = 0;
+
+		/* Parse all complete lines, and the last one at end of file.
+		 */
+		char *line = buf, *eol;
+		while ((eol = memchr(line, '\n', buf + len - line)) != NULL
+				|| (n == 0 && line < buf + len)) {
+			line_nr++;
+			if (eol != NULL)
+				*eol = 0;
+			if (parse_line(line, ctx) < 0)
+				prerror_and_exit("Malformed line %ld in '%s' file, aborting.\n",
+						line_nr, fname);
+			line = eol != NULL ? eol + 1 : buf + len;
+		}
+
+		/* Keep the partial line, growing the buffer when it fills it.
+		 */
+		len -= line - buf;
+		memmove(buf, line, len);
+		if (len == buf_size) {
+			buf_size *= 2;
+			buf = (char *) realloc(buf, buf_size + 1);
+			if (buf == NULL)
+				prerror_and_exit("Error: Cannot allocate memory to read '%s'.\n",
+						fname);
+		}
+	} while (n > 0);
+	if (ferror(fp))
+		prerror_and_exit("Error reading '%s' file, aborting.\n", fname);
+	free(buf);
+}
+
+int add_coords_line(char *line, void *size) {
+	COORDS c;
+	int res = parse_coords_line(line, &c);
+	if (res > 0)
+		add_coords(&c, (int *) size);
+	return res;
+}
+
+/* Save the coordinates just read in the binary format.
+ */
+void write_xy_binary(char *fname) {
+	unsigned char r[COORDS_BINARY_RECORD];
+	int i;
+
+	FILE *fp = fopen(fname, "w");
+	if (fp == NULL)
+		prerror_and_exit("Cannot open '%s' file, aborting.\n", fname);
+	fwrite(COORDS_BINARY_MAGIC, 1, 8, fp);
+	for (i = 0; i < num_coords; i++) {
+		COORDS *c = coords + i;
+		set_int(c->original_field_record, r);
+		set_int(c->trace_seq_within_reel, r + 4);
+		set_int(c->trace_seq_within_field_record, r + 8);
+		set_int(c->unit_of_measure_1_feet_or_meters_2_arcsec, r + 12);
+		set_double8(c->lon_or_x, r + 16);
+		set_double8(c->lat_or_y, r + 24);
+		set_double8(c->elevation, r + 32);
+		if (fwrite(r, COORDS_BINARY_RECORD, 1, fp) != 1)
+			prerror_and_exit("Error writing '%s' file, aborting.\n", fname);
+	}
+	if (fclose(fp) != 0)
+		prerror_and_exit("Error writing '%s' file, aborting.\n", fname);
+}
+
+void read_xy(char *fname) {
+	char magic[8];
+	int i;
+
+	num_coords = 0;
+	max_x = max_y = max_z = -1e100;
+	min_x = min_y = min_z = 1e100;
+
+	FILE *fp = fopen(fname, "r");
+	if (fp == NULL)
+		prerror_and_exit("Cannot open '%s' file, aborting.\n", fname);
+
+	if (fread(magic, 1, 8, fp) == 8
+			&& memcmp(magic, COORDS_BINARY_MAGIC, 8) == 0)
+		read_xy_binary(fp, fname);
+	else {
+		int size = 0;
+		rewind(fp);
+		read_text_lines(fp, fname, add_coords_line, &size);
+	}
+	fclose(fp);
+
+	if (save_coordinates_fname != NULL)
+		write_xy_binary(save_coordinates_fname);
+
+	/* Find the max and min in order to properly scale the numbers.
+	 */
+	for (i = 0; i < num_coords; i++) {
+		max_x = my_max(max_x, coords[i].lon_or_x);
+		max_y = my_max(max_y, coords[i].lat_or_y);
+		min_x = my_min(min_x, coords[i].lon_or_x);
+		min_y = my_min(min_y, coords[i].lat_or_y);
+		if (!isnan(coords[i].elevation)) {
+			max_z = my_max(max_z, coords[i].elevation);
+			min_z = my_min(min_z, coords[i].elevation);
+		}
+	}
+
+	double _max = my_max(fabs(my_max(max_x, max_y)),
+			fabs(my_min(min_x, min_y)));
+	double _max_z = max_z < min_z ? 1 : my_max(fabs(max_z), fabs(min_z));
 
 	/* Compute optimal scaling factor for coordinates.
 	 */
+	coordinates_scaling_factor = scalar_for_magnitude(_max);
+	elevation_scaling_factor = scalar_for_magnitude(_max_z);
 
 	if (verbose == 1) {
 		printf("%d entries read from '%s' file\n", num_coords, fname);
@@ -1039,99 +1715,500 @@ void read_xy(char *fname) {
 
 	/* Scale the values.
 	 */
-	if (coordinates_scaling_factor < 0)
-		scaling = -1.0 / coordinates_scaling_factor;
-	else
-		scaling = coordinates_scaling_factor;
-	int i;
+	double scaling = scalar_divisor(coordinates_scaling_factor);
+	double scaling_z = scalar_divisor(elevation_scaling_factor);
 	for (i = 0; i < num_coords; i++) {
 		coords[i].lon_or_x = coords[i].lon_or_x / scaling; // divide because when read the scaling is a multiply factor
 		coords[i].lat_or_y = coords[i].lat_or_y / scaling; // divide because when read the scaling is a multiply factor
+		coords[i].elevation = coords[i].elevation / scaling_z;
 	}
 
+	build_trace_key_index(&coords_index, coords, num_coords, sizeof(COORDS));
+
 	/* all done, we are ready to use the data.
 	 */
 }
 
-/* SHOW SEGY HEADER INFORMATION.
+/* NAVIGATION MERGE.
+ * -add_nav reads one position per line, keyed either on the time
+ *   year day_of_year hour minute second x y unit
+ * or on the record number
+ *   record x y unit
+ * and gives every trace the position linearly interpolated at the time
+ * of its trace header, or at its original field record number.
  */
-void print_segy_info() {
-	if (use_names) {
-		int j = 0;
-		fprintf(stdout,
-				"--------------------------------------------------------------\n"
-						"                        SEG Y FORMAT\n"
-						"--------------------------------------------------------------\n"
-						"SEG Y format was developed by the Society of\n"
-						"Exploration Geophysicists (SEG) as an exchange format for\n"
-						"demultiplexed seismic data on 9-track tape.\n"
-						"A tape reel is divided into a tape identification header\n"
-						"followed by multiple trace data blocks. The tape identification\n"
-						"header can also be omitted for data residing on disks.\n"
-						"\n\n"
-						"--------------------------------------------------------------\n"
-						"             SEG Y tape Identification Header\n"
-						"--------------------------------------------------------------\n"
-						"The SEGY tape identification header is made by an EBCDIC\n"
-						"block and by a binary block. The EBCDIC block is\n"
-						"composed of 40 cards (80 bytes per card) for a total of\n"
-						"3200 bytes. Each card begins with 'C' and bytes at offsets\n"
-						"ranging from 29 to 39 are left unassigned for optional use.\n"
-						"Unused cards are filled with EBCDIC blank code.\n"
-						"After the EBCDIC block begins a 400 byte long binary block.\n\n"
-						"Offset Type           Parameter\n");
-		while (segy_header_names[j]) {
-			fprintf(stdout, "%5d ", segy_header_types[j * 2]);
-			switch (segy_header_types[j * 2 + 1]) {
-			case 'I':
-				fprintf(stdout, " Integer ");
-				break;
-			case 'S':
-				fprintf(stdout, " Short   ");
-				break;
-			}
-			fprintf(stdout, " %s\n", segy_header_names[j]);
-			j++;
-		}
-		fprintf(stdout,
-				"\n--------------------------------------------------------------\n"
-						"                      SEG Y Trace Header\n"
-						"--------------------------------------------------------------\n\n"
-						"Offset Type           Parameter\n");
-		j = 0;
-		while (trace_header_names[j]) {
-			fprintf(stdout, "%5d ", trace_header_types[j * 2]);
-			switch (trace_header_types[j * 2 + 1]) {
-			case 'I':
-				fprintf(stdout, " Integer ");
-				break;
-			case 'S':
-				fprintf(stdout, " Short   ");
-				break;
-			}
-			fprintf(stdout, " %s\n", trace_header_names[j]);
-			j++;
+typedef struct {
+	double key, x, y;
+	int unit_of_measure_1_feet_or_meters_2_arcsec;
+} NAV_POINT;
+
+NAV_POINT *nav_points;
+int num_nav_points;
+bool add_nav, nav_by_time;
+
+/* Seconds from year 0 to the given time, for comparisons only.
+ */
+double nav_time(long year, long day, long hour, long minute, double second) {
+	long y = year - 1;
+	long days = 365 * y + y / 4 - y / 100 + y / 400 + day - 1;
+	return days * 86400.0 + hour * 3600.0 + minute * 60.0 + second;
+}
+
+int compare_nav_points(const void *a, const void *b) {
+	double d = ((const NAV_POINT *) a)->key - ((const NAV_POINT *) b)->key;
+	return my_sgn(d);
+}
+
+/* Parse a line of the navigation file into a new point.
+ * RETURN: 1 ON SUCCESS, 0 FOR A BLANK LINE, -1 WHEN MALFORMED.
+ */
+int parse_nav_line(char *line, void *size) {
+	long t[4];
+	double second;
+	NAV_POINT p;
+	int i;
+
+	line = skip_blanks(line);
+	if (*line == '\r' || *line == 0)
+		return 0;
+	if (nav_by_time) {
+		for (i = 0; i < 4; i++) {
+			line = parse_long(skip_blanks(line), t + i);
+			if (line == NULL || !end_of_token(line))
+				return -1;
 		}
+		line = parse_double(skip_blanks(line), &second);
+		if (line == NULL || !end_of_token(line))
+			return -1;
+		p.key = nav_time(t[0], t[1], t[2], t[3], second);
+	} else {
+		line = parse_double(line, &p.key);
+		if (line == NULL || !end_of_token(line))
+			return -1;
+	}
+	line = parse_double(skip_blanks(line), &p.x);
+	if (line == NULL || !end_of_token(line))
+		return -1;
+	line = parse_double(skip_blanks(line), &p.y);
+	if (line == NULL || !end_of_token(line))
+		return -1;
 
-		return;
+	/* The unit, meters when missing.
+	 */
+	char *unit = line = skip_blanks(line);
+	while (!end_of_token(line))
+		line++;
+	if (line == unit || (line - unit == 4 && strncmp(unit, "feet", 4) == 0)
+			|| (line - unit == 6 && strncmp(unit, "meters", 6) == 0))
+		p.unit_of_measure_1_feet_or_meters_2_arcsec = 1;
+	else if (line - unit == 6 && strncmp(unit, "arcsec", 6) == 0)
+		p.unit_of_measure_1_feet_or_meters_2_arcsec = 2;
+	else
+		return -1;
+	line = skip_blanks(line);
+	if (*line != '\r' && *line != 0)
+		return -1;
+
+	if (num_nav_points == *(long *) size) {
+		*(long *) size = *(long *) size ? *(long *) size * 2 : 4096;
+		nav_points = (NAV_POINT *) realloc(nav_points,
+				*(long *) size * sizeof(NAV_POINT));
+		if (nav_points == NULL)
+			prerror_and_exit("Error: Cannot allocate memory for the navigation.\n");
 	}
-	fprintf(stdout,
-			"--------------------------------------------------------------\n"
-					"                        SEG Y FORMAT\n"
-					"--------------------------------------------------------------\n"
-					"SEG Y format was developed by the Society of\n"
-					"Exploration Geophysicists (SEG) as an exchange format for\n"
-					"demultiplexed seismic data on 9-track tape.\n"
-					"A tape reel is divided into a tape identification header\n"
-					"followed by multiple trace data blocks. The tape identification\n"
-					"header can also be omitted for data residing on disks.\n"
-					"\n\n"
-					"--------------------------------------------------------------\n"
-					"             SEG Y tape Identification Header\n"
-					"--------------------------------------------------------------\n"
-					"The SEGY tape identification header is made by an EBCDIC\n"
-					"block and by a binary block. The EBCDIC block is\n"
-					"composed of 40 cards (80 bytes per card) for a total of\n"
+	nav_points[num_nav_points++] = p;
+	return 1;
+}
+
+void read_nav(char *fname) {
+	long size = 0;
+	double _max = 0;
+	int i;
+
+	FILE *fp = fopen(fname, "r");
+	if (fp == NULL)
+		prerror_and_exit("Cannot open '%s' file, aborting.\n", fname);
+
+	num_nav_points = 0;
+	read_text_lines(fp, fname, parse_nav_line, &size);
+	for (i = 0; i < num_nav_points; i++)
+		_max = my_max(_max, my_max(fabs(nav_points[i].x),
+				fabs(nav_points[i].y)));
+	fclose(fp);
+	if (num_nav_points == 0)
+		prerror_and_exit("No positions found into '%s' file, aborting.\n", fname);
+
+	qsort(nav_points, num_nav_points, sizeof(NAV_POINT), compare_nav_points);
+	coordinates_scaling_factor = scalar_for_magnitude(_max);
+	double scaling = scalar_divisor(coordinates_scaling_factor);
+	for (i = 0; i < num_nav_points; i++) {
+		nav_points[i].x /= scaling;
+		nav_points[i].y /= scaling;
+	}
+
+	if (verbose == 1) {
+		printf("%d positions read from '%s' file\n", num_nav_points, fname);
+		printf("scaling factor = %d.\n", coordinates_scaling_factor);
+	}
+}
+
+/* Interpolate the position at key.
+ * RETURN: 0 ON SUCCESS, -1 WHEN key IS OUT OF THE NAVIGATION.
+ */
+int interpolate_nav(double key, double *x, double *y, int *unit) {
+	int lo = 0, hi = num_nav_points - 1;
+
+	if (key < nav_points[lo].key || key > nav_points[hi].key)
+		return -1;
+	/* Find the last point not after key.
+	 */
+	while (lo < hi) {
+		int mid = (lo + hi + 1) / 2;
+		if (nav_points[mid].key <= key)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+
+	NAV_POINT *a = nav_points + lo;
+	*unit = a->unit_of_measure_1_feet_or_meters_2_arcsec;
+	if (a->key == key || lo == num_nav_points - 1) {
+		*x = a->x;
+		*y = a->y;
+	} else {
+		double t = (key - a->key) / (a[1].key - a->key);
+		*x = a->x + (a[1].x - a->x) * t;
+		*y = a->y + (a[1].y - a->y) * t;
+	}
+	return 0;
+}
+
+/* KEYED TRACE HEADER UPDATE.
+ * -update_trace_fields loads a table of header values keyed on record,
+ * sequence and trace number of the input file, and applies its rows to
+ * the matching traces in whatever order they come; traces without a row
+ * are left untouched. The text table is comma separated, its first line
+ * names the columns:
+ *   record,sequence,trace,field,...
+ * where a field is a parameter name or offset:type, an empty cell leaves
+ * the field unchanged. The binary table starts with UPDATE_BINARY_MAGIC,
+ * then big endian int32 number of fields, int32 offset and type ('S',
+ * 'I' or 'F') of each field, and records of int32 record, sequence,
+ * trace followed by a float64 per field, NaN to leave it unchanged.
+ */
+#define UPDATE_BINARY_MAGIC "SEGYTUB1"
+
+typedef struct {
+	int rec, seq, num;
+} TRACE_KEY;
+
+bool update_fields;
+FIELD_SPEC *update_columns;
+int num_update_columns, num_update_rows, update_rows_size;
+TRACE_KEY *update_keys;
+double *update_values;
+TRACE_KEY_INDEX update_index;
+
+void add_update_column(int offset, char type) {
+	if (type != 'S' && type != 'I' && type != 'F')
+		prerror_and_exit("-update_trace_fields: unknown type '%c'.\n", type);
+	if (offset < 0 || offset + (type == 'S' ? 2 : 4) > 240)
+		prerror_and_exit("FATAL ERROR: field offset %d out of the header.\n",
+				offset);
+	update_columns = (FIELD_SPEC *) realloc(update_columns,
+			(num_update_columns + 1) * sizeof(FIELD_SPEC));
+	if (update_columns == NULL)
+		prerror_and_exit("Error: Cannot allocate memory for the fields.\n");
+	FIELD_SPEC *f = update_columns + num_update_columns++;
+	memset(f, 0, sizeof(FIELD_SPEC));
+	f->offset = offset;
+	f->type = type;
+	f->name_index = -1;
+}
+
+/* RETURN: TRUE WHEN v CAN BE STORED INTO THE FIELD WITHOUT WRAPPING, NaN
+ * (LEAVE THE FIELD AS IT IS) INCLUDED.
+ */
+bool update_value_fits(FIELD_SPEC *f, double v) {
+	if (isnan(v))
+		return true;
+	switch (f->type) {
+	case 'S':
+		v = round(v);
+		return v >= -32768.0 && v <= 32767.0;
+	case 'I':
+		v = round(v);
+		return v >= -2147483648.0 && v <= 2147483647.0;
+	default:
+		return fabs(v) <= FLT_MAX;
+	}
+}
+
+/* RETURN: THE VALUES OF THE NEW ROW, TO BE FILLED BY THE CALLER.
+ */
+double *add_update_row(long rec, long seq, long num) {
+	if (num_update_rows == update_rows_size) {
+		update_rows_size = update_rows_size ? update_rows_size * 2 : 4096;
+		update_keys = (TRACE_KEY *) realloc(update_keys,
+				update_rows_size * sizeof(TRACE_KEY));
+		update_values = (double *) realloc(update_values,
+				(size_t) update_rows_size * num_update_columns
+						* sizeof(double));
+		if (update_keys == NULL || update_values == NULL)
+			prerror_and_exit("Error: Cannot allocate memory for the fields.\n");
+	}
+	TRACE_KEY *k = update_keys + num_update_rows;
+	k->rec = rec;
+	k->seq = seq;
+	k->num = num;
+	return update_values + (size_t) num_update_rows++ * num_update_columns;
+}
+
+int parse_update_header(char *line) {
+	char name[256];
+	int col = 0, l, p;
+
+	line = skip_blanks(line);
+	if (*line == 0)
+		return 0;
+	for (;;) {
+		line = skip_blanks(line);
+		for (l = 0; *line != ',' && *line != 0 && l < 255; line++)
+			name[l++] = *line;
+		while (l > 0 && (name[l - 1] == ' ' || name[l - 1] == '\t'
+				|| name[l - 1] == '\r'))
+			l--;
+		name[l] = 0;
+
+		/* The first three columns are the key.
+		 */
+		if (col++ >= 3) {
+			char *colon = strchr(name, ':');
+			if (isdigit((unsigned char) name[0]) && colon != NULL)
+				add_update_column(atoi(name), colon[1]);
+			else {
+				p = get_parameter_index_by_name(trace_header_names, name);
+				add_update_column(trace_header_types[p * 2],
+						trace_header_types[p * 2 + 1]);
+			}
+		}
+		if (*line != ',')
+			break;
+		line++;
+	}
+	if (col < 4)
+		return -1;
+	return 1;
+}
+
+int parse_update_line(char *line, void *ctx) {
+	long key[3];
+	int i;
+
+	(void) ctx;
+	if (num_update_columns == 0)
+		return parse_update_header(line);
+
+	line = skip_blanks(line);
+	if (*line == 0)
+		return 0;
+	for (i = 0; i < 3; i++) {
+		line = parse_long(skip_blanks(line), key + i);
+		if (line == NULL)
+			return -1;
+		line = skip_blanks(line);
+		if (*line != ',')
+			return -1;
+		line++;
+	}
+	double *v = add_update_row(key[0], key[1], key[2]);
+	for (i = 0; i < num_update_columns; i++)
+		v[i] = NAN;
+	for (i = 0;; i++) {
+		line = skip_blanks(line);
+		if (*line != ',' && *line != 0) {
+			if (i >= num_update_columns)
+				return -1;
+			line = parse_double(line, v + i);
+			if (line == NULL || !update_value_fits(update_columns + i, v[i]))
+				return -1;
+			line = skip_blanks(line);
+		}
+		if (*line == 0)
+			return 1;
+		if (*line != ',')
+			return -1;
+		line++;
+	}
+}
+
+void read_update_binary(FILE *fp, char *fname) {
+	unsigned char b[8];
+	int i, n;
+
+	if (fread(b, 4, 1, fp) != 1)
+		prerror_and_exit("Error reading '%s' file, aborting.\n", fname);
+	n = get_int(b);
+	for (i = 0; i < n; i++) {
+		if (fread(b, 8, 1, fp) != 1)
+			prerror_and_exit("Error reading '%s' file, aborting.\n", fname);
+		add_update_column(get_int(b), get_int(b + 4));
+	}
+	if (num_update_columns == 0)
+		prerror_and_exit("No fields into '%s' file, aborting.\n", fname);
+
+	size_t rec_size = 12 + 8 * num_update_columns;
+	unsigned char *r = (unsigned char *) malloc(rec_size);
+	if (r == NULL)
+		prerror_and_exit("Error: Cannot allocate memory for the fields.\n");
+	size_t len;
+	while ((len = fread(r, 1, rec_size, fp)) > 0) {
+		if (len != rec_size)
+			prerror_and_exit("'%s' file is truncated, aborting.\n", fname);
+		double *v = add_update_row(get_int(r), get_int(r + 4), get_int(r + 8));
+		for (i = 0; i < num_update_columns; i++) {
+			v[i] = get_double8(r + 12 + 8 * i);
+			if (!update_value_fits(update_columns + i, v[i]))
+				prerror_and_exit("Value %g of record %d out of the range of field %d:%c in '%s' file, aborting.\n",
+						v[i], num_update_rows, update_columns[i].offset,
+						update_columns[i].type, fname);
+		}
+	}
+	if (ferror(fp))
+		prerror_and_exit("Error reading '%s' file, aborting.\n", fname);
+	free(r);
+}
+
+void read_update_table(char *fname) {
+	char magic[8];
+
+	FILE *fp = fopen(fname, "r");
+	if (fp == NULL)
+		prerror_and_exit("Cannot open '%s' file, aborting.\n", fname);
+	if (fread(magic, 1, 8, fp) == 8
+			&& memcmp(magic, UPDATE_BINARY_MAGIC, 8) == 0)
+		read_update_binary(fp, fname);
+	else {
+		rewind(fp);
+		read_text_lines(fp, fname, parse_update_line, NULL);
+	}
+	fclose(fp);
+
+	build_trace_key_index(&update_index, update_keys, num_update_rows,
+			sizeof(TRACE_KEY));
+	if (verbose == 1)
+		printf("%d rows of %d fields read from '%s' file\n", num_update_rows,
+				num_update_columns, fname);
+}
+
+/* Store a value into a big endian header field.
+ */
+void set_field_value(unsigned char *header, FIELD_SPEC *f, double v) {
+	switch (f->type) {
+	case 'S':
+		set_short((short) lround(v), header + f->offset);
+		break;
+	case 'I':
+		set_int((int) lround(v), header + f->offset);
+		break;
+	case 'F':
+		set_ieee((float) v, header + f->offset);
+		break;
+	}
+}
+
+/* Read a value from a big endian header field.
+ */
+double get_field_value(unsigned char *header, FIELD_SPEC *f) {
+	switch (f->type) {
+	case 'S':
+		return get_short(header + f->offset);
+	case 'I':
+		return get_int(header + f->offset);
+	default:
+		return get_ieee(header + f->offset);
+	}
+}
+
+/* SHOW SEGY HEADER INFORMATION.
+ */
+void print_segy_info() {
+	if (use_names) {
+		int j = 0;
+		fprintf(stdout,
+				"--------------------------------------------------------------\n"
+						"                        SEG Y FORMAT\n"
+						"--------------------------------------------------------------\n"
+						"SEG Y format was developed by the Society of\n"
+						"Exploration Geophysicists (SEG) as an exchange format for\n"
+						"demultiplexed seismic data on 9-track tape.\n"
+						"A tape reel is divided into a tape identification header\n"
+						"followed by multiple trace data blocks. The tape identification\n"
+						"header can also be omitted for data residing on disks.\n"
+						"\n\n"
+						"--------------------------------------------------------------\n"
+						"             SEG Y tape Identification Header\n"
+						"--------------------------------------------------------------\n"
+						"The SEGY tape identification header is made by an EBCDIC\n"
+						"block and by a binary block. The EBCDIC block is\n"
+						"composed of 40 cards (80 bytes per card) for a total of\n"
+						"3200 bytes. Each card begins with 'C' and bytes at offsets\n"
+						"ranging from 29 to 39 are left unassigned for optional use.\n"
+						"Unused cards are filled with EBCDIC blank code.\n"
+						"After the EBCDIC block begins a 400 byte long binary block.\n\n"
+						"Offset Type           Parameter\n");
+		while (segy_header_names[j]) {
+			fprintf(stdout, "%5d ", segy_header_types[j * 2]);
+			switch (segy_header_types[j * 2 + 1]) {
+			case 'I':
+				fprintf(stdout, " Integer ");
+				break;
+			case 'S':
+				fprintf(stdout, " Short   ");
+				break;
+			}
+			fprintf(stdout, " %s\n", segy_header_names[j]);
+			j++;
+		}
+		fprintf(stdout,
+				"\n--------------------------------------------------------------\n"
+						"                      SEG Y Trace Header\n"
+						"--------------------------------------------------------------\n\n"
+						"Offset Type           Parameter\n");
+		j = 0;
+		while (trace_header_names[j]) {
+			fprintf(stdout, "%5d ", trace_header_types[j * 2]);
+			switch (trace_header_types[j * 2 + 1]) {
+			case 'I':
+				fprintf(stdout, " Integer ");
+				break;
+			case 'S':
+				fprintf(stdout, " Short   ");
+				break;
+			}
+			fprintf(stdout, " %s\n", trace_header_names[j]);
+			j++;
+		}
+
+		return;
+	}
+	fprintf(stdout,
+			"--------------------------------------------------------------\n"
+					"                        SEG Y FORMAT\n"
+					"--------------------------------------------------------------\n"
+					"SEG Y format was developed by the Society of\n"
+					"Exploration Geophysicists (SEG) as an exchange format for\n"
+					"demultiplexed seismic data on 9-track tape.\n"
+					"A tape reel is divided into a tape identification header\n"
+					"followed by multiple trace data blocks. The tape identification\n"
+					"header can also be omitted for data residing on disks.\n"
+					"\n\n"
+					"--------------------------------------------------------------\n"
+					"             SEG Y tape Identification Header\n"
+					"--------------------------------------------------------------\n"
+					"The SEGY tape identification header is made by an EBCDIC\n"
+					"block and by a binary block. The EBCDIC block is\n"
+					"composed of 40 cards (80 bytes per card) for a total of\n"
 					"3200 bytes. Each card begins with 'C' and bytes at offsets\n"
 					"ranging from 29 to 39 are left unassigned for optional use.\n"
 					"Unused cards are filled with EBCDIC blank code.\n"
@@ -1313,44 +2390,309 @@ int trace_data_length(SEGY_file *segy_file) {
 					&segy_file->trace_header);
 }
 
-void ibm2ieee(void *to, const void *from, int len) {
-	register unsigned fr;
-	register int exp;
-	register int sgn;
+/* RETURN: TRUE WHEN trace_sample_length KNOWS THE SAMPLE FORMAT.
+ */
+bool is_fixed_sample_format(SEGY_file *segy_file) {
+	switch (GET_SEGYH_Data_sample_format_code(&segy_file->header)) {
+	case 1:
+	case 2:
+	case 3:
+	case 5:
+		return true;
+	default:
+		return false;
+	}
+}
+
+/* Convert the bits of a big endian IBM float, already in host order, to
+ * the bits of an IEEE 754 float.
+ */
+unsigned int ibm_to_ieee_bits(unsigned int fr) {
+	int exp;
+	int sgn;
+
+	sgn = fr >> 31;
+	fr <<= 1;
+	exp = fr >> 25;
+	fr <<= 7;
+
+	if (fr == 0)
+		return sgn << 31;
+
+	exp = (exp << 2) - 130;
 
-		fr = ntohl(*(long *) from);
-		sgn = fr >> 31;
+	while (fr < 0x80000000) {
+		--exp;
 		fr <<= 1;
-		exp = fr >> 25;
-		fr <<= 7;
+	}
+
+	if (exp <= 0) {
+		if (exp < -24)
+			fr = 0;
+		else
+			fr >>= -exp;
+		exp = 0;
+	} else if (exp >= 255) {
+		fr = 0;
+		exp = 255;
+	} else {
+		fr <<= 1;
+	}
+
+	return (fr >> 9) | (exp << 23) | (sgn << 31);
+}
+
+void ibm_to_ieee_scalar(const unsigned char *src, float *dst, int n) {
+	int i;
+	uint32_t w;
+
+	for (i = 0; i < n; i++) {
+		memcpy(&w, src + i * 4, 4);
+		w = ibm_to_ieee_bits(ntohl(w));
+		memcpy(dst + i, &w, 4);
+	}
+}
+
+#ifdef WITH_X86_SIMD
+/* The SIMD kernels convert the 24 bit fraction with cvtepi32_ps, which is
+ * exact and normalises it (the leading zero count ends up in the float
+ * exponent), then add 4 * exponent - 280 to the exponent field. Zero
+ * fractions give a signed zero and too big exponents infinity, as in
+ * ibm_to_ieee_bits(). A group holding a result below the normal range
+ * is done by the scalar code, which truncates it to a denormal.
+ */
+__attribute__((target("sse2")))
+void ibm_to_ieee_sse2(const unsigned char *src, float *dst, int n) {
+	int i;
+	const __m128i sign_mask = _mm_set1_epi32(0x80000000);
+	const __m128i frac_mask = _mm_set1_epi32(0x00ffffff);
+	const __m128i exp_mask = _mm_set1_epi32(0x7f);
+	const __m128i bias = _mm_set1_epi32(280);
+	const __m128i one = _mm_set1_epi32(1);
+	const __m128i max_exp = _mm_set1_epi32(254);
+	const __m128i inf = _mm_set1_epi32(0x7f800000);
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		__m128i x = _mm_loadu_si128((const __m128i *) (src + i * 4));
+		x = _mm_shufflelo_epi16(x, _MM_SHUFFLE(2, 3, 0, 1));
+		x = _mm_shufflehi_epi16(x, _MM_SHUFFLE(2, 3, 0, 1));
+		x = _mm_or_si128(_mm_slli_epi16(x, 8), _mm_srli_epi16(x, 8));
+
+		__m128i sign = _mm_and_si128(x, sign_mask);
+		__m128i frac = _mm_and_si128(x, frac_mask);
+		__m128i delta = _mm_sub_epi32(
+				_mm_slli_epi32(_mm_and_si128(_mm_srli_epi32(x, 24), exp_mask), 2),
+				bias);
+		__m128i f = _mm_castps_si128(_mm_cvtepi32_ps(frac));
+		__m128i e = _mm_add_epi32(_mm_srli_epi32(f, 23), delta);
+		__m128i zero = _mm_cmpeq_epi32(frac, _mm_setzero_si128());
+		__m128i under = _mm_andnot_si128(zero, _mm_cmplt_epi32(e, one));
+		if (_mm_movemask_epi8(under)) {
+			ibm_to_ieee_scalar(src + i * 4, dst + i, 4);
+			continue;
+		}
+		__m128i over = _mm_cmpgt_epi32(e, max_exp);
+		__m128i r = _mm_add_epi32(f, _mm_slli_epi32(delta, 23));
+		r = _mm_or_si128(_mm_andnot_si128(over, r), _mm_and_si128(over, inf));
+		r = _mm_or_si128(_mm_andnot_si128(zero, r), sign);
+		_mm_storeu_si128((__m128i *) (dst + i), r);
+	}
+	ibm_to_ieee_scalar(src + i * 4, dst + i, n - i);
+}
 
-		if (fr == 0) {
-			exp = 0;
-			goto done;
+__attribute__((target("avx2")))
+void ibm_to_ieee_avx2(const unsigned char *src, float *dst, int n) {
+	int i;
+	const __m256i bswap = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9,
+			8, 15, 14, 13, 12, 3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13,
+			12);
+	const __m256i sign_mask = _mm256_set1_epi32(0x80000000);
+	const __m256i frac_mask = _mm256_set1_epi32(0x00ffffff);
+	const __m256i exp_mask = _mm256_set1_epi32(0x7f);
+	const __m256i bias = _mm256_set1_epi32(280);
+	const __m256i one = _mm256_set1_epi32(1);
+	const __m256i max_exp = _mm256_set1_epi32(254);
+	const __m256i inf = _mm256_set1_epi32(0x7f800000);
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		__m256i x = _mm256_loadu_si256((const __m256i *) (src + i * 4));
+		x = _mm256_shuffle_epi8(x, bswap);
+
+		__m256i sign = _mm256_and_si256(x, sign_mask);
+		__m256i frac = _mm256_and_si256(x, frac_mask);
+		__m256i delta = _mm256_sub_epi32(
+				_mm256_slli_epi32(
+						_mm256_and_si256(_mm256_srli_epi32(x, 24), exp_mask), 2),
+				bias);
+		__m256i f = _mm256_castps_si256(_mm256_cvtepi32_ps(frac));
+		__m256i e = _mm256_add_epi32(_mm256_srli_epi32(f, 23), delta);
+		__m256i zero = _mm256_cmpeq_epi32(frac, _mm256_setzero_si256());
+		__m256i under = _mm256_andnot_si256(zero, _mm256_cmpgt_epi32(one, e));
+		if (!_mm256_testz_si256(under, under)) {
+			ibm_to_ieee_scalar(src + i * 4, dst + i, 8);
+			continue;
 		}
+		__m256i over = _mm256_cmpgt_epi32(e, max_exp);
+		__m256i r = _mm256_add_epi32(f, _mm256_slli_epi32(delta, 23));
+		r = _mm256_blendv_epi8(r, inf, over);
+		r = _mm256_or_si256(_mm256_andnot_si256(zero, r), sign);
+		_mm256_storeu_si256((__m256i *) (dst + i), r);
+	}
+	ibm_to_ieee_sse2(src + i * 4, dst + i, n - i);
+}
+#endif
+
+void (*ibm_to_ieee_kernel)(const unsigned char *src, float *dst, int n);
+
+/* Pick the fastest IBM to IEEE kernel this CPU can run.
+ */
+void select_ibm_to_ieee_kernel() {
+	ibm_to_ieee_kernel = ibm_to_ieee_scalar;
+#ifdef WITH_X86_SIMD
+	if (__builtin_cpu_supports("avx2"))
+		ibm_to_ieee_kernel = ibm_to_ieee_avx2;
+	else if (__builtin_cpu_supports("sse2"))
+		ibm_to_ieee_kernel = ibm_to_ieee_sse2;
+#endif
+}
+
+/* Convert len big endian IBM floats at from to IEEE 754 floats at to.
+ */
+void ibm2ieee(void *to, const void *from, int len) {
+	ibm_to_ieee_kernel((const unsigned char *) from, (float *) to, len);
+}
+
+void ieee_to_ibm_scalar(const float *src, unsigned char *dst, int n) {
+	int i;
+	uint32_t w;
 
-		exp = (exp << 2) - 130;
+	for (i = 0; i < n; i++) {
+		memcpy(&w, src + i, 4);
+		w = htonl(ieee_to_ibm_bits(w));
+		memcpy(dst + i * 4, &w, 4);
+	}
+}
 
-		while (fr < 0x80000000) {
-			--exp;
-			fr <<= 1;
+#ifdef WITH_X86_SIMD
+/* The SIMD kernels build a float worth mantissa / 2^shift, where shift
+ * (0 to 3) brings the exponent to a multiple of 4, and round it to an
+ * integer with cvtps_epi32, which rounds to nearest even. A group with
+ * a denormal, infinity or NaN is done by the scalar code.
+ */
+__attribute__((target("sse2")))
+void ieee_to_ibm_sse2(const float *src, unsigned char *dst, int n) {
+	int i;
+	const __m128i sign_mask = _mm_set1_epi32(0x80000000);
+	const __m128i abs_mask = _mm_set1_epi32(0x7fffffff);
+	const __m128i mant_mask = _mm_set1_epi32(0x007fffff);
+	const __m128i min_normal = _mm_set1_epi32(0x00800000);
+	const __m128i max_normal = _mm_set1_epi32(0x7f7fffff);
+	const __m128i carry_val = _mm_set1_epi32(0x01000000);
+	const __m128i three = _mm_set1_epi32(3);
+	const __m128i four = _mm_set1_epi32(4);
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		__m128i v = _mm_loadu_si128((const __m128i *) (src + i));
+		__m128i sign = _mm_and_si128(v, sign_mask);
+		__m128i a = _mm_and_si128(v, abs_mask);
+		__m128i zero = _mm_cmpeq_epi32(a, _mm_setzero_si128());
+		__m128i odd = _mm_or_si128(
+				_mm_andnot_si128(zero, _mm_cmplt_epi32(a, min_normal)),
+				_mm_cmpgt_epi32(a, max_normal));
+		if (_mm_movemask_epi8(odd)) {
+			ieee_to_ibm_scalar(src + i, dst + i * 4, 4);
+			continue;
 		}
+		__m128i tmp = _mm_sub_epi32(_mm_srli_epi32(a, 23), _mm_set1_epi32(126));
+		__m128i shift = _mm_and_si128(_mm_sub_epi32(_mm_setzero_si128(), tmp),
+				three);
+		__m128i f = _mm_or_si128(
+				_mm_slli_epi32(_mm_sub_epi32(_mm_set1_epi32(150), shift), 23),
+				_mm_and_si128(a, mant_mask));
+		__m128i r = _mm_cvtps_epi32(_mm_castsi128_ps(f));
+		__m128i carry = _mm_cmpeq_epi32(r, carry_val);
+		r = _mm_or_si128(_mm_andnot_si128(carry, r),
+				_mm_and_si128(carry, _mm_srli_epi32(r, 4)));
+		tmp = _mm_add_epi32(_mm_add_epi32(tmp, shift), _mm_and_si128(carry, four));
+		__m128i e = _mm_add_epi32(_mm_srai_epi32(tmp, 2), _mm_set1_epi32(64));
+		r = _mm_or_si128(_mm_slli_epi32(e, 24), r);
+		r = _mm_or_si128(_mm_andnot_si128(zero, r), sign);
+		r = _mm_shufflelo_epi16(r, _MM_SHUFFLE(2, 3, 0, 1));
+		r = _mm_shufflehi_epi16(r, _MM_SHUFFLE(2, 3, 0, 1));
+		r = _mm_or_si128(_mm_slli_epi16(r, 8), _mm_srli_epi16(r, 8));
+		_mm_storeu_si128((__m128i *) (dst + i * 4), r);
+	}
+	ieee_to_ibm_scalar(src + i, dst + i * 4, n - i);
+}
 
-		if (exp <= 0) {
-			if (exp < -24)
-				fr = 0;
-			else
-				fr >>= -exp;
-			exp = 0;
-		} else if (exp >= 255) {
-			fr = 0;
-			exp = 255;
-		} else {
-			fr <<= 1;
+__attribute__((target("avx2")))
+void ieee_to_ibm_avx2(const float *src, unsigned char *dst, int n) {
+	int i;
+	const __m256i bswap = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9,
+			8, 15, 14, 13, 12, 3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13,
+			12);
+	const __m256i sign_mask = _mm256_set1_epi32(0x80000000);
+	const __m256i abs_mask = _mm256_set1_epi32(0x7fffffff);
+	const __m256i mant_mask = _mm256_set1_epi32(0x007fffff);
+	const __m256i min_normal = _mm256_set1_epi32(0x00800000);
+	const __m256i max_normal = _mm256_set1_epi32(0x7f7fffff);
+	const __m256i carry_val = _mm256_set1_epi32(0x01000000);
+	const __m256i three = _mm256_set1_epi32(3);
+	const __m256i four = _mm256_set1_epi32(4);
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		__m256i v = _mm256_loadu_si256((const __m256i *) (src + i));
+		__m256i sign = _mm256_and_si256(v, sign_mask);
+		__m256i a = _mm256_and_si256(v, abs_mask);
+		__m256i zero = _mm256_cmpeq_epi32(a, _mm256_setzero_si256());
+		__m256i odd = _mm256_or_si256(
+				_mm256_andnot_si256(zero, _mm256_cmpgt_epi32(min_normal, a)),
+				_mm256_cmpgt_epi32(a, max_normal));
+		if (!_mm256_testz_si256(odd, odd)) {
+			ieee_to_ibm_scalar(src + i, dst + i * 4, 8);
+			continue;
 		}
+		__m256i tmp = _mm256_sub_epi32(_mm256_srli_epi32(a, 23),
+				_mm256_set1_epi32(126));
+		__m256i shift = _mm256_and_si256(
+				_mm256_sub_epi32(_mm256_setzero_si256(), tmp), three);
+		__m256i f = _mm256_or_si256(
+				_mm256_slli_epi32(_mm256_sub_epi32(_mm256_set1_epi32(150), shift),
+						23), _mm256_and_si256(a, mant_mask));
+		__m256i r = _mm256_cvtps_epi32(_mm256_castsi256_ps(f));
+		__m256i carry = _mm256_cmpeq_epi32(r, carry_val);
+		r = _mm256_blendv_epi8(r, _mm256_srli_epi32(r, 4), carry);
+		tmp = _mm256_add_epi32(_mm256_add_epi32(tmp, shift),
+				_mm256_and_si256(carry, four));
+		__m256i e = _mm256_add_epi32(_mm256_srai_epi32(tmp, 2),
+				_mm256_set1_epi32(64));
+		r = _mm256_or_si256(_mm256_slli_epi32(e, 24), r);
+		r = _mm256_or_si256(_mm256_andnot_si256(zero, r), sign);
+		_mm256_storeu_si256((__m256i *) (dst + i * 4),
+				_mm256_shuffle_epi8(r, bswap));
+	}
+	ieee_to_ibm_sse2(src + i, dst + i * 4, n - i);
+}
+#endif
+
+void (*ieee_to_ibm_kernel)(const float *src, unsigned char *dst, int n);
+
+/* Pick the fastest IEEE to IBM kernel this CPU can run.
+ */
+void select_ieee_to_ibm_kernel() {
+	ieee_to_ibm_kernel = ieee_to_ibm_scalar;
+#ifdef WITH_X86_SIMD
+	if (__builtin_cpu_supports("avx2"))
+		ieee_to_ibm_kernel = ieee_to_ibm_avx2;
+	else if (__builtin_cpu_supports("sse2"))
+		ieee_to_ibm_kernel = ieee_to_ibm_sse2;
+#endif
+}
 
-		done:
-		*(unsigned *) to = (fr >> 9) | (exp << 23) | (sgn << 31);
+/* Convert len IEEE 754 floats at from to big endian IBM floats at to.
+ */
+void ieee2ibm(void *to, const void *from, int len) {
+	ieee_to_ibm_kernel((const float *) from, (unsigned char *) to, len);
 }
 
 /* Convert from segy_file->format to double
@@ -1413,45 +2755,534 @@ void set_val(double value_to_convert, SEGY_file *segy_file, void *addr, int idx)
 	prerror_and_exit("Error: Unknown Format.\n");
 }
 
-void flip_trace_data_endianess(SEGY_file *segy_file) {
-	if (flip_endianess) {
-		switch (GET_SEGYH_Data_sample_format_code(&segy_file->header)) {
-		case 1:
-		case 2:
-		case 5:
-			for (i = 0; i < n_samples; i++)
-				swap4((unsigned int*) (segy_file->trace_data + i * 4));
-			break;
-		case 3:
-			for (i = 0; i < n_samples; i++)
-				swap2((unsigned short*) (segy_file->trace_data + i * 2));
-			break;
-		}
-	}
+/* SINGLE SAMPLE CONVERSIONS.
+ * Between a big endian sample of each integer or IEEE format and double,
+ * inlined into the block loops below.
+ */
+static inline double load_int_sample(const unsigned char *p) {
+	uint32_t w;
+	memcpy(&w, p, 4);
+	return (int32_t) ntohl(w);
 }
 
-void flip_trace_header_endianess(SEGY_file *segy_file) {
-	/* Flip the endianess if it's the case.
-	 */
+static inline double load_short_sample(const unsigned char *p) {
+	uint16_t w;
+	memcpy(&w, p, 2);
+	return (int16_t) ntohs(w);
+}
+
+static inline double load_ieee_sample(const unsigned char *p) {
+	uint32_t w;
+	float f;
+	memcpy(&w, p, 4);
+	w = ntohl(w);
+	memcpy(&f, &w, 4);
+	return f;
+}
+
+static inline void store_int_sample(double v, unsigned char *p) {
+	uint32_t w = htonl((uint32_t) (int) v);
+	memcpy(p, &w, 4);
+}
+
+static inline void store_short_sample(double v, unsigned char *p) {
+	uint16_t w = htons((uint16_t) (short) v);
+	memcpy(p, &w, 2);
+}
+
+static inline void store_ieee_sample(double v, unsigned char *p) {
+	float f = (float) v;
+	uint32_t w;
+	memcpy(&w, &f, 4);
+	w = htonl(w);
+	memcpy(p, &w, 4);
+}
+
+/* BLOCK DECODERS.
+ * Convert n big endian samples at src to double, one function per format
+ * code, so the format is looked up once per file instead of per sample.
+ */
+void decode_ibm_samples(const unsigned char *src, double *dst, int n) {
+	int i, j, m;
+	float f[1024];
+
+	for (i = 0; i < n; i += m) {
+		m = my_min(n - i, 1024);
+		ibm2ieee(f, src + i * 4, m);
+		for (j = 0; j < m; j++)
+			dst[i + j] = f[j];
+	}
+}
+
+void decode_int_samples(const unsigned char *src, double *dst, int n) {
+	int i;
+	for (i = 0; i < n; i++)
+		dst[i] = load_int_sample(src + i * 4);
+}
+
+void decode_short_samples(const unsigned char *src, double *dst, int n) {
+	int i;
+	for (i = 0; i < n; i++)
+		dst[i] = load_short_sample(src + i * 2);
+}
+
+void decode_ieee_samples(const unsigned char *src, double *dst, int n) {
+	int i;
+	for (i = 0; i < n; i++)
+		dst[i] = load_ieee_sample(src + i * 4);
+}
+
+void decode_unknown_samples(const unsigned char *src, double *dst, int n) {
+	(void) src, (void) dst, (void) n;
+	prerror_and_exit("Error: Unknown Format.\n");
+}
+
+/* BLOCK ENCODERS.
+ * The reverse of the decoders: store n doubles at src as big endian
+ * samples, with the same conversions as set_val().
+ */
+void encode_ibm_samples(const double *src, unsigned char *dst, int n) {
+	int i, j, m;
+	float f[1024];
+
+	for (i = 0; i < n; i += m) {
+		m = my_min(n - i, 1024);
+		for (j = 0; j < m; j++)
+			f[j] = (float) src[i + j];
+		ieee2ibm(dst + i * 4, f, m);
+	}
+}
+
+void encode_int_samples(const double *src, unsigned char *dst, int n) {
+	int i;
+	for (i = 0; i < n; i++)
+		store_int_sample(src[i], dst + i * 4);
+}
+
+void encode_short_samples(const double *src, unsigned char *dst, int n) {
+	int i;
+	for (i = 0; i < n; i++)
+		store_short_sample(src[i], dst + i * 2);
+}
+
+void encode_ieee_samples(const double *src, unsigned char *dst, int n) {
+	int i;
+	for (i = 0; i < n; i++)
+		store_ieee_sample(src[i], dst + i * 4);
+}
+
+void encode_unknown_samples(const double *src, unsigned char *dst, int n) {
+	(void) src, (void) dst, (void) n;
+	prerror_and_exit("Error: Unknown Format.\n");
+}
+
+/* Pick the block decoder and encoder for the sample format of segy_file.
+ */
+void set_sample_codecs(SEGY_file *segy_file) {
+	switch (GET_SEGYH_Data_sample_format_code(&segy_file->header)) {
+	case 1:
+		segy_file->decode_samples = decode_ibm_samples;
+		segy_file->encode_samples = encode_ibm_samples;
+		break;
+	case 2:
+		segy_file->decode_samples = decode_int_samples;
+		segy_file->encode_samples = encode_int_samples;
+		break;
+	case 3:
+		segy_file->decode_samples = decode_short_samples;
+		segy_file->encode_samples = encode_short_samples;
+		break;
+	case 5:
+		segy_file->decode_samples = decode_ieee_samples;
+		segy_file->encode_samples = encode_ieee_samples;
+		break;
+	default:
+		segy_file->decode_samples = decode_unknown_samples;
+		segy_file->encode_samples = encode_unknown_samples;
+		break;
+	}
+}
+
+/* TRANSCODERS.
+ * Convert n big endian samples at src straight to another format at dst,
+ * one function per pair of format codes, without the double buffer of
+ * decode_samples() and encode_samples() but with the same conversions.
+ */
+#define TRANSCODER(name, load, load_size, store, store_size) \
+void name(const unsigned char *src, unsigned char *dst, int n) { \
+	int i; \
+	for (i = 0; i < n; i++) \
+		store(load(src + i * load_size), dst + i * store_size); \
+}
+
+#define TRANSCODER_FROM_IBM(name, store, store_size) \
+void name(const unsigned char *src, unsigned char *dst, int n) { \
+	int i, j, m; \
+	float f[1024]; \
+	for (i = 0; i < n; i += m) { \
+		m = my_min(n - i, 1024); \
+		ibm2ieee(f, src + i * 4, m); \
+		for (j = 0; j < m; j++) \
+			store(f[j], dst + (i + j) * store_size); \
+	} \
+}
+
+#define TRANSCODER_TO_IBM(name, load, load_size) \
+void name(const unsigned char *src, unsigned char *dst, int n) { \
+	int i, j, m; \
+	float f[1024]; \
+	for (i = 0; i < n; i += m) { \
+		m = my_min(n - i, 1024); \
+		for (j = 0; j < m; j++) \
+			f[j] = (float) load(src + (i + j) * load_size); \
+		ieee2ibm(dst + i * 4, f, m); \
+	} \
+}
+
+TRANSCODER_FROM_IBM(transcode_ibm_to_int, store_int_sample, 4)
+TRANSCODER_FROM_IBM(transcode_ibm_to_short, store_short_sample, 2)
+TRANSCODER_FROM_IBM(transcode_ibm_to_ieee, store_ieee_sample, 4)
+TRANSCODER_TO_IBM(transcode_int_to_ibm, load_int_sample, 4)
+TRANSCODER(transcode_int_to_short, load_int_sample, 4, store_short_sample, 2)
+TRANSCODER(transcode_int_to_ieee, load_int_sample, 4, store_ieee_sample, 4)
+TRANSCODER_TO_IBM(transcode_short_to_ibm, load_short_sample, 2)
+TRANSCODER(transcode_short_to_int, load_short_sample, 2, store_int_sample, 4)
+TRANSCODER(transcode_short_to_ieee, load_short_sample, 2, store_ieee_sample, 4)
+TRANSCODER_TO_IBM(transcode_ieee_to_ibm, load_ieee_sample, 4)
+TRANSCODER(transcode_ieee_to_int, load_ieee_sample, 4, store_int_sample, 4)
+TRANSCODER(transcode_ieee_to_short, load_ieee_sample, 4, store_short_sample, 2)
+
+void transcode_unknown_samples(const unsigned char *src, unsigned char *dst,
+		int n) {
+	(void) src, (void) dst, (void) n;
+	prerror_and_exit("Error: Unknown Format.\n");
+}
+
+/* Pick the transcoder from the format of source to the one of dest.
+ */
+void set_sample_transcoder(SEGY_file *source, SEGY_file *dest) {
+	int from = GET_SEGYH_Data_sample_format_code(&source->header);
+	int to = GET_SEGYH_Data_sample_format_code(&dest->header);
+
+	dest->transcode_samples = transcode_unknown_samples;
+	switch (from * 10 + to) {
+	case 12:
+		dest->transcode_samples = transcode_ibm_to_int;
+		break;
+	case 13:
+		dest->transcode_samples = transcode_ibm_to_short;
+		break;
+	case 15:
+		dest->transcode_samples = transcode_ibm_to_ieee;
+		break;
+	case 21:
+		dest->transcode_samples = transcode_int_to_ibm;
+		break;
+	case 23:
+		dest->transcode_samples = transcode_int_to_short;
+		break;
+	case 25:
+		dest->transcode_samples = transcode_int_to_ieee;
+		break;
+	case 31:
+		dest->transcode_samples = transcode_short_to_ibm;
+		break;
+	case 32:
+		dest->transcode_samples = transcode_short_to_int;
+		break;
+	case 35:
+		dest->transcode_samples = transcode_short_to_ieee;
+		break;
+	case 51:
+		dest->transcode_samples = transcode_ieee_to_ibm;
+		break;
+	case 52:
+		dest->transcode_samples = transcode_ieee_to_int;
+		break;
+	case 53:
+		dest->transcode_samples = transcode_ieee_to_short;
+		break;
+	}
+}
+
+/* SAMPLE STATISTICS.
+ * Min, max, sum and sum of squares of the finite samples of a decoded
+ * trace, with the count of zero, NaN or infinite and clipped samples,
+ * all in a single sweep. Clipped samples are the finite ones whose
+ * magnitude reaches clip, none when clip is 0.
+ */
+typedef struct {
+	long n, zeros, non_finite, clipped;
+	double min, max, sum, sum2; /* Of the finite samples. */
+} SAMPLE_STATS;
+
+void clear_sample_stats(SAMPLE_STATS *s) {
+	memset(s, 0, sizeof(*s));
+	s->min = INFINITY;
+	s->max = -INFINITY;
+}
+
+void merge_sample_stats(SAMPLE_STATS *to, const SAMPLE_STATS *from) {
+	to->n += from->n;
+	to->zeros += from->zeros;
+	to->non_finite += from->non_finite;
+	to->clipped += from->clipped;
+	to->min = my_min(to->min, from->min);
+	to->max = my_max(to->max, from->max);
+	to->sum += from->sum;
+	to->sum2 += from->sum2;
+}
+
+void sample_stats_scalar(const double *v, int n, double clip, SAMPLE_STATS *s) {
+	int i;
+
+	for (i = 0; i < n; i++) {
+		double x = v[i];
+		if (!isfinite(x)) {
+			s->non_finite++;
+			continue;
+		}
+		if (x == 0)
+			s->zeros++;
+		if (clip > 0 && fabs(x) >= clip)
+			s->clipped++;
+		s->min = my_min(s->min, x);
+		s->max = my_max(s->max, x);
+		s->sum += x;
+		s->sum2 += x * x;
+	}
+	s->n += n;
+}
+
+#ifdef WITH_X86_SIMD
+/* Non finite lanes are replaced by the neutral value of each reduction
+ * and counted apart.
+ */
+__attribute__((target("avx2")))
+void sample_stats_avx2(const double *v, int n, double clip, SAMPLE_STATS *s) {
+	int i;
+	const __m256d abs_mask = _mm256_castsi256_pd(
+			_mm256_set1_epi64x(0x7fffffffffffffffLL));
+	const __m256d inf = _mm256_set1_pd(INFINITY);
+	const __m256d minus_inf = _mm256_set1_pd(-INFINITY);
+	const __m256d zero = _mm256_setzero_pd();
+	const __m256d c = _mm256_set1_pd(clip > 0 ? clip : INFINITY);
+	__m256d mn = inf, mx = minus_inf, sum = zero, sum2 = zero;
+	long zeros = 0, finite_count = 0, clipped = 0;
+	double lanes[4];
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		__m256d x = _mm256_loadu_pd(v + i);
+		__m256d a = _mm256_and_pd(x, abs_mask);
+		__m256d finite = _mm256_cmp_pd(a, inf, _CMP_LT_OQ);
+		__m256d xf = _mm256_and_pd(x, finite);
+		mn = _mm256_min_pd(mn, _mm256_blendv_pd(inf, x, finite));
+		mx = _mm256_max_pd(mx, _mm256_blendv_pd(minus_inf, x, finite));
+		sum = _mm256_add_pd(sum, xf);
+		sum2 = _mm256_add_pd(sum2, _mm256_mul_pd(xf, xf));
+		finite_count += __builtin_popcount(_mm256_movemask_pd(finite));
+		zeros += __builtin_popcount(
+				_mm256_movemask_pd(_mm256_cmp_pd(x, zero, _CMP_EQ_OQ)));
+		clipped += __builtin_popcount(
+				_mm256_movemask_pd(
+						_mm256_and_pd(_mm256_cmp_pd(a, c, _CMP_GE_OQ), finite)));
+	}
+
+	s->n += i;
+	s->zeros += zeros;
+	s->non_finite += i - finite_count;
+	s->clipped += clipped;
+	_mm256_storeu_pd(lanes, mn);
+	s->min = my_min(s->min, my_min(my_min(lanes[0], lanes[1]),
+			my_min(lanes[2], lanes[3])));
+	_mm256_storeu_pd(lanes, mx);
+	s->max = my_max(s->max, my_max(my_max(lanes[0], lanes[1]),
+			my_max(lanes[2], lanes[3])));
+	_mm256_storeu_pd(lanes, sum);
+	s->sum += (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+	_mm256_storeu_pd(lanes, sum2);
+	s->sum2 += (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+	sample_stats_scalar(v + i, n - i, clip, s);
+}
+#endif
+
+void (*sample_stats_kernel)(const double *v, int n, double clip,
+		SAMPLE_STATS *s);
+
+/* Pick the fastest statistics kernel this CPU can run.
+ */
+void select_sample_stats_kernel() {
+	sample_stats_kernel = sample_stats_scalar;
+#ifdef WITH_X86_SIMD
+	if (__builtin_cpu_supports("avx2"))
+		sample_stats_kernel = sample_stats_avx2;
+#endif
+}
+
+/* Compute into s the statistics of the n samples at v.
+ */
+void sample_stats(const double *v, int n, double clip, SAMPLE_STATS *s) {
+	clear_sample_stats(s);
+	sample_stats_kernel(v, n, clip, s);
+}
+
+/* QC REPORT.
+ * With -qc the statistics of every trace, of every record and of the
+ * whole file are written to a text file.
+ */
+bool qc;
+FILE *qc_fp;
+double qc_clip;
+SAMPLE_STATS trace_stats, qc_record_stats, qc_total_stats;
+long qc_record_nr, qc_record_traces, qc_total_traces;
+
+/* The clip level given with -qc or else the full scale of the integer
+ * formats.
+ */
+double qc_clip_level(SEGY_file *segy_file) {
+	if (qc_clip > 0)
+		return qc_clip;
+	switch (GET_SEGYH_Data_sample_format_code(&segy_file->header)) {
+	case 2:
+		return 2147483647.0;
+	case 3:
+		return 32767.0;
+	default:
+		return 0;
+	}
+}
+
+void flip_trace_data_endianess(SEGY_file *segy_file) {
 	if (flip_endianess) {
-		int kk = 0;
-		while (trace_header_types[kk * 2] != -1) {
-			switch (trace_header_types[kk * 2 + 1]) {
-			case 'I':
-			case 'F':
-				swap4(
-						(unsigned int *) ((unsigned char*) (&(segy_file->trace_header.HEADER))
-								+ trace_header_types[kk * 2]));
-				break;
-			case 'S':
-				swap2(
-						(unsigned short *) ((unsigned char *) (&(segy_file->trace_header.HEADER))
-								+ trace_header_types[kk * 2]));
-				break;
-			}
-			kk++;
+		switch (GET_SEGYH_Data_sample_format_code(&segy_file->header)) {
+		case 1:
+		case 2:
+		case 5:
+			swap_bytes(segy_file->trace_data, n_samples, 4);
+			break;
+		case 3:
+			swap_bytes(segy_file->trace_data, n_samples, 2);
+			break;
+		}
+	}
+}
+
+/* The trace header flip as a byte shuffle: byte k of the flipped header
+ * is byte trace_header_shuffle[k] of the original one. It is made once
+ * from trace_header_types; no field crosses a 16 byte block, so each
+ * block is a single pshufb with the low 4 bits of the indexes.
+ */
+unsigned char trace_header_shuffle[240];
+bool trace_header_shuffle_in_blocks;
+
+void make_trace_header_shuffle() {
+	int kk = 0, k;
+
+	for (k = 0; k < 240; k++)
+		trace_header_shuffle[k] = k;
+	while (trace_header_types[kk * 2] != -1) {
+		switch (trace_header_types[kk * 2 + 1]) {
+		case 'I':
+		case 'F':
+			swap4((unsigned int *) (trace_header_shuffle
+					+ trace_header_types[kk * 2]));
+			break;
+		case 'S':
+			swap2((unsigned short *) (trace_header_shuffle
+					+ trace_header_types[kk * 2]));
+			break;
 		}
+		kk++;
+	}
+	trace_header_shuffle_in_blocks = true;
+	for (k = 0; k < 240; k++)
+		if (trace_header_shuffle[k] / 16 != k / 16)
+			trace_header_shuffle_in_blocks = false;
+}
+
+#ifdef WITH_X86_SIMD
+__attribute__((target("ssse3")))
+void shuffle_trace_header_ssse3(unsigned char *h) {
+	int k;
+
+	for (k = 0; k < 240; k += 16) {
+		__m128i x = _mm_loadu_si128((__m128i *) (h + k));
+		__m128i m = _mm_and_si128(
+				_mm_loadu_si128((__m128i *) (trace_header_shuffle + k)),
+				_mm_set1_epi8(15));
+		_mm_storeu_si128((__m128i *) (h + k), _mm_shuffle_epi8(x, m));
+	}
+}
+
+/* 7 AVX2 shuffles of 32 bytes, then an SSE one for the last 16 bytes.
+ */
+__attribute__((target("avx2")))
+void shuffle_trace_header_avx2(unsigned char *h) {
+	int k;
+
+	for (k = 0; k + 32 <= 240; k += 32) {
+		__m256i x = _mm256_loadu_si256((__m256i *) (h + k));
+		__m256i m = _mm256_and_si256(
+				_mm256_loadu_si256((__m256i *) (trace_header_shuffle + k)),
+				_mm256_set1_epi8(15));
+		_mm256_storeu_si256((__m256i *) (h + k), _mm256_shuffle_epi8(x, m));
+	}
+	__m128i x = _mm_loadu_si128((__m128i *) (h + k));
+	__m128i m = _mm_and_si128(
+			_mm_loadu_si128((__m128i *) (trace_header_shuffle + k)),
+			_mm_set1_epi8(15));
+	_mm_storeu_si128((__m128i *) (h + k), _mm_shuffle_epi8(x, m));
+}
+#endif
+
+void shuffle_trace_header_scalar(unsigned char *h) {
+	unsigned char tmp[240];
+	int k;
+
+	memcpy(tmp, h, 240);
+	for (k = 0; k < 240; k++)
+		h[k] = tmp[trace_header_shuffle[k]];
+}
+
+void (*shuffle_trace_header)(unsigned char *h);
+
+/* Make the trace header shuffle and pick the fastest kernel this CPU can
+ * run it with.
+ */
+void select_trace_header_shuffle() {
+	make_trace_header_shuffle();
+	shuffle_trace_header = shuffle_trace_header_scalar;
+#ifdef WITH_X86_SIMD
+	if (trace_header_shuffle_in_blocks) {
+		if (__builtin_cpu_supports("avx2"))
+			shuffle_trace_header = shuffle_trace_header_avx2;
+		else if (__builtin_cpu_supports("ssse3"))
+			shuffle_trace_header = shuffle_trace_header_ssse3;
 	}
+#endif
+}
+
+void flip_trace_header_endianess(SEGY_file *segy_file) {
+	/* Flip the endianess if it's the case.
+	 */
+	if (flip_endianess)
+		shuffle_trace_header(
+				(unsigned char *) &segy_file->trace_header.HEADER);
+}
+
+/* Pick all the SIMD kernels once, from main before any thread starts, so
+ * that the kernel calls need no check and the threads never race to set
+ * them.
+ */
+void select_kernels() {
+#ifdef WITH_X86_SIMD
+	__builtin_cpu_init();
+#endif
+	select_swap_bytes_kernel();
+	select_ibm_to_ieee_kernel();
+	select_ieee_to_ibm_kernel();
+	select_sample_stats_kernel();
+	select_trace_header_shuffle();
 }
 
 void flip_header_endianess(SEGY_file *segy_file) {
@@ -1496,22 +3327,22 @@ void copy_segy_trace_data(SEGY_file *source, SEGY_file *dest) {
 	int i;
 	if ((dest->trace_data = (unsigned char *) realloc(dest->trace_data,
 			trace_data_length(dest)))) {
-		int start = 0, end = n_samples;
+		int source_nsamples =
+				GET_SEGYTRACEH_USHORT_Number_of_samples_in_this_trace(
+						&source->trace_header);
+		int start = 0, end = source_nsamples;
 //		if (skip_nsamples != -1)
 //			start = skip_nsamples;
 //		if (only_nsamples != -1)
 //			end = start + only_nsamples;
-		int source_nsamples =
-				GET_SEGYTRACEH_USHORT_Number_of_samples_in_this_trace(
-						&source->trace_header);
 		if (vertical_stack > 1) { // DO THE VERTICAL STACKING
 			int j, k = 0;
 			for (i = start; i < end; i += vertical_stack) {
 				double val = 0;
 				for (j = 0; j < vertical_stack; j++)
-					val += GET_IN_SAMPLE(i + j);
+					val += get_val(source, source->trace_data, i + j);
 
-				SET_OUT_SAMPLE(val, k);
+				set_val(val, dest, dest->trace_data, k);
 				k++;
 			}
 
@@ -1519,12 +3350,9 @@ void copy_segy_trace_data(SEGY_file *source, SEGY_file *dest) {
 			memset(dest->trace_data, 0, trace_data_length(dest));
 			if (GET_SEGYH_Data_sample_format_code(
 					&source->header) != GET_SEGYH_Data_sample_format_code(&dest->header)) {
-				dest->trace_data = (unsigned char *) realloc(dest->trace_data,
-						trace_data_length(dest));
-				for (i = start; i < my_min(end, source_nsamples); i++) {
-					set_val(get_val(source, source->trace_data, i), dest,
-							dest->trace_data, i - start);
-				}
+				dest->transcode_samples(source->trace_data + start
+						* trace_sample_length(source), dest->trace_data,
+						my_min(end, source_nsamples) - start);
 			} else {
 //				if (skip_nsamples != -1)
 //					memcpy(dest->trace_data,
@@ -1542,20 +3370,255 @@ void copy_segy_trace_data(SEGY_file *source, SEGY_file *dest) {
 	}
 }
 
+/* Write all the given blocks with writev, retrying on short writes.
+ */
+void writev_segy_blocks(SEGY_file *dest, struct iovec *iov, int iovcnt) {
+	int fd = fileno(dest->fp);
+
+	fflush(dest->fp); /* Never overtake what stdio may still hold. */
+	while (iovcnt > 0) {
+		ssize_t w = writev(fd, iov, iovcnt);
+		if (w < 0) {
+			if (errno == EINTR)
+				continue;
+			dest->out_buffer_len = 0; /* Cannot be written either. */
+			prerror_and_exit("Error while writing '%s': %s\n", dest->fname,
+					strerror(errno));
+		}
+		while (iovcnt > 0 && (size_t) w >= iov->iov_len) {
+			w -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (unsigned char *) iov->iov_base + w;
+			iov->iov_len -= w;
+		}
+	}
+}
+
+/* Append two blocks (the second one may be empty) to the output buffer,
+ * if they do not fit the buffer content and both blocks are written
+ * together with a single writev.
+ */
+void write_segy_bytes(SEGY_file *dest, const void *p1, size_t l1,
+		const void *p2, size_t l2) {
+	if (dest->out_buffer == NULL && out_buffer_mb > 0) {
+		dest->out_buffer_size = out_buffer_mb * 1024 * 1024;
+		dest->out_buffer = (unsigned char *) malloc(dest->out_buffer_size);
+		if (dest->out_buffer == NULL)
+			prerror_and_exit("Error: Cannot allocate memory for the output buffer.\n");
+		dest->out_buffer_len = 0;
+	}
+
+	if (dest->out_buffer_len + l1 + l2 <= dest->out_buffer_size) {
+		memcpy(dest->out_buffer + dest->out_buffer_len, p1, l1);
+		memcpy(dest->out_buffer + dest->out_buffer_len + l1, p2, l2);
+		dest->out_buffer_len += l1 + l2;
+		return;
+	}
+
+	struct iovec iov[3];
+	int n = 0;
+	if (dest->out_buffer_len > 0) {
+		iov[n].iov_base = dest->out_buffer;
+		iov[n++].iov_len = dest->out_buffer_len;
+	}
+	iov[n].iov_base = (void *) p1;
+	iov[n++].iov_len = l1;
+	if (l2 > 0) {
+		iov[n].iov_base = (void *) p2;
+		iov[n++].iov_len = l2;
+	}
+	writev_segy_blocks(dest, iov, n);
+	dest->out_buffer_len = 0;
+}
+
+void flush_segy_output(SEGY_file *dest) {
+	if (dest->out_buffer_len > 0) {
+		struct iovec iov;
+		iov.iov_base = dest->out_buffer;
+		iov.iov_len = dest->out_buffer_len;
+		writev_segy_blocks(dest, &iov, 1);
+		dest->out_buffer_len = 0;
+	}
+}
+
+/* Called by prerror_and_exit, so that the traces written before the error
+ * reach the output file as they did before the output buffer. Once only,
+ * as a failed write lands here again.
+ */
+void flush_output_on_error() {
+	static bool flushing;
+	if (flushing || out_segy_file.fp == NULL || out_segy_file.out_buffer_len == 0)
+		return;
+	flushing = true;
+	flush_segy_output(&out_segy_file);
+}
+
 void write_segy_header(SEGY_file *dest) {
 	if (replace_ebcdic) {
 		memcpy(&dest->header, my_ebcdic, 3200);
 	}
 
-	fwrite(&dest->header, sizeof(dest->header), 1, dest->fp);
+	write_segy_bytes(dest, &dest->header, sizeof(dest->header), NULL, 0);
+}
+
+/* Queue trace header and trace data to the output file.
+ */
+void write_segy_trace(SEGY_file *dest) {
+	write_segy_bytes(dest, &dest->trace_header, sizeof(dest->trace_header),
+			dest->trace_data, trace_data_length(dest));
+}
+
+/* READ len BYTES FROM THE INPUT FILE, EITHER FROM THE MEMORY MAP OR WITH fread.
+ * RETURN: THE NUMBER OF BYTES READ, A SHORT COUNT MEANS END OF FILE.
+ */
+size_t read_segy_bytes(SEGY_file *segy_file, void *buf, size_t len) {
+	if (segy_file->map == NULL)
+		return fread(buf, 1, len, segy_file->fp);
+
+	off_t avail = segy_file->map_size - segy_file->map_pos;
+	if (avail < 0)
+		avail = 0;
+	if ((off_t) len > avail) {
+		len = avail;
+		segy_file->at_eof = true;
+	}
+	memcpy(buf, segy_file->map + segy_file->map_pos, len);
+	segy_file->map_pos += len;
+	return len;
+}
+
+/* RETURN A POINTER TO THE NEXT len BYTES OF THE MEMORY MAPPED INPUT,
+ * WITHOUT COPYING THEM, OR NULL IF THE FILE ENDS TOO EARLY.
+ */
+unsigned char *map_segy_bytes(SEGY_file *segy_file, size_t len) {
+	unsigned char *p = segy_file->map + segy_file->map_pos;
+	if (segy_file->map_pos + (off_t) len > segy_file->map_size) {
+		segy_file->map_pos = segy_file->map_size;
+		segy_file->at_eof = true;
+		return NULL;
+	}
+	segy_file->map_pos += len;
+	return p;
+}
+
+/* SKIP THE NEXT len BYTES OF THE INPUT FILE, SEEKING WHEN IT CAN.
+ * RETURN: THE NUMBER OF BYTES SKIPPED, A SHORT COUNT MEANS END OF FILE.
+ */
+size_t skip_segy_bytes(SEGY_file *segy_file, size_t len) {
+	struct stat st;
+	off_t pos;
+
+	if (segy_file->map != NULL) {
+		off_t avail = segy_file->map_size - segy_file->map_pos;
+		if (avail < 0)
+			avail = 0;
+		if ((off_t) len > avail) {
+			len = avail;
+			segy_file->at_eof = true;
+		}
+		segy_file->map_pos += len;
+		return len;
+	}
+
+	/* Seeking costs some system calls, worth it only when whole pages
+	 * are left unread.
+	 */
+	if (len >= 2 * (size_t) sysconf(_SC_PAGESIZE)
+			&& (pos = ftello(segy_file->fp)) >= 0
+			&& fstat(fileno(segy_file->fp), &st) == 0
+			&& S_ISREG(st.st_mode)) {
+		off_t avail = my_max(st.st_size - pos, 0);
+		if ((off_t) len > avail)
+			len = avail;
+		fseeko(segy_file->fp, pos + len, SEEK_SET);
+		return len;
+	}
+
+	/* Small traces or a pipe, read and drop. */
+	unsigned char buf[65536];
+	size_t done = 0, r;
+	while (done < len && (r = fread(buf, 1, my_min(len - done, sizeof(buf)),
+			segy_file->fp)) > 0)
+		done += r;
+	return done;
 }
 
-void write_segy_trace_header(SEGY_file *dest) {
-	fwrite(&dest->trace_header, sizeof(dest->trace_header), 1, dest->fp);
+/* With large traces and only the trace headers to read, tell the kernel
+ * not to read ahead the samples in between.
+ */
+void advise_header_only(SEGY_file *segy_file) {
+	long page = sysconf(_SC_PAGESIZE);
+	long data_len = (long) GET_SEGYH_Number_of_samples_per_datatrace_for_this_reel(
+			&segy_file->header) * trace_sample_length(segy_file);
+
+	if (!header_only || segy_file->fp == NULL || segy_file->fp == stdin
+			|| page <= 0 || data_len < 2 * page)
+		return;
+	if (segy_file->map != NULL)
+		madvise(segy_file->map, segy_file->map_size, MADV_RANDOM);
+	else
+		posix_fadvise(fileno(segy_file->fp), 0, 0, POSIX_FADV_RANDOM);
+}
+
+int segy_eof(SEGY_file *segy_file) {
+	if (prefetch_active)
+		return segy_file->at_eof;
+	if (segy_file->map == NULL)
+		return feof(segy_file->fp);
+	return segy_file->at_eof;
+}
+
+off_t segy_tell(SEGY_file *segy_file) {
+	if (prefetch_active)
+		return prefetch_pos;
+	if (segy_file->map == NULL)
+		return ftello(segy_file->fp);
+	return segy_file->map_pos;
+}
+
+int segy_seek(SEGY_file *segy_file, off_t offset, int whence) {
+	if (segy_file->map == NULL)
+		return fseeko(segy_file->fp, offset, whence);
+
+	if (whence == SEEK_CUR)
+		offset += segy_file->map_pos;
+	else if (whence == SEEK_END)
+		offset += segy_file->map_size;
+	segy_file->map_pos = offset;
+	segy_file->at_eof = false;
+	return 0;
+}
+
+/* Try to map the whole input file in memory, on failure (pipes, stdin, ...)
+ * the stdio stream will be used.
+ */
+void map_segy_file(SEGY_file *segy_file) {
+	struct stat st;
+	int fd = fileno(segy_file->fp);
+
+	if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0
+			|| (off_t) (size_t) st.st_size != st.st_size)
+		return;
+
+	void *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (p == MAP_FAILED)
+		return;
+	madvise(p, st.st_size, MADV_SEQUENTIAL);
+
+	segy_file->map = (unsigned char *) p;
+	segy_file->map_size = st.st_size;
+	segy_file->map_pos = 0;
+	segy_file->at_eof = false;
 }
 
-void write_segy_trace_data(SEGY_file *dest) {
-	fwrite(dest->trace_data, 1, trace_data_length(dest), dest->fp);
+void unmap_segy_file(SEGY_file *segy_file) {
+	if (segy_file->map != NULL) {
+		munmap(segy_file->map, segy_file->map_size);
+		segy_file->map = NULL;
+	}
 }
 
 /* OPEN THE SEGY FILE.
@@ -1582,7 +3645,9 @@ int open_segy(SEGY_file *segy_file, char *fname, char *mode, off_t initial_seek)
 	}
 
 	if (segy_file->fp != NULL) {
-		fseek(segy_file->fp, initial_seek, SEEK_SET);
+		if (use_mmap && mode[0] == 'r' && segy_file->fp != stdin)
+			map_segy_file(segy_file);
+		segy_seek(segy_file, initial_seek, SEEK_SET);
 		return 0;
 	} else
 		return -1;
@@ -1590,23 +3655,14 @@ int open_segy(SEGY_file *segy_file, char *fname, char *mode, off_t initial_seek)
 
 void do_change_header() {
 	if (change_header_fields) {
-		int field_segy_offset;
-		char field_segy_type;
-		int m_field_nr = 1;
-		char m_field[1000], m_fields[1000], value[1000];
-		while (get_field(header_fields_to_change, m_field_nr, m_fields, ',')) {
-			get_field(m_fields, 1, m_field, ':');
-			field_segy_offset = atoi(m_field);
-			get_field(m_fields, 2, m_field, ':');
-			field_segy_type = m_field[0];
-			get_field(m_fields, 3, value, ':');
+		int k;
+		for (k = 0; k < num_header_fields_change; k++) {
+			FIELD_SPEC *f = header_fields_change + k;
 			if (output_segy)
-				set_str_val((unsigned char*) (&out_segy_file.header), value,
-						field_segy_offset, field_segy_type);
-			set_str_val((unsigned char*) (&segy_file.header), value,
-					field_segy_offset, field_segy_type);
-
-			m_field_nr++;
+				set_str_val((unsigned char*) (&out_segy_file.header), f->text,
+						f->offset, f->type);
+			set_str_val((unsigned char*) (&segy_file.header), f->text,
+					f->offset, f->type);
 		}
 	}
 
@@ -1638,6 +3694,10 @@ void do_change_header() {
 				get_short((void*) (&out_segy_file.header) + 3220)
 						/ vertical_stack, (void*) &out_segy_file.header + 3220);
 	}
+
+	set_sample_codecs(&segy_file);
+	set_sample_codecs(&out_segy_file);
+	set_sample_transcoder(&segy_file, &out_segy_file);
 }
 
 /* READ FROM file THE SEGY HEADER
@@ -1649,12 +3709,13 @@ int get_segy_header(SEGY_file *segy_file, int verbose) {
 
 	/* READ 3200 + 400 BYTES
 	 */
-	bytes_read = fread(&(segy_file->header), sizeof(segy_file->header), 1,
-			segy_file->fp);
-	if (bytes_read != 1)
+	bytes_read = read_segy_bytes(segy_file, &(segy_file->header),
+			sizeof(segy_file->header));
+	if (bytes_read != sizeof(segy_file->header))
 		prerror_and_exit("Cannot read the SEGY HEADER.\n");
 
 	flip_header_endianess(segy_file);
+	set_sample_codecs(segy_file);
 
 	if (n_traces == 0)
 		n_traces = GET_SEGYH_Number_of_data_traces_per_record(
@@ -1663,31 +3724,22 @@ int get_segy_header(SEGY_file *segy_file, int verbose) {
 	/* Check and dump segy_header fields.
 	 */
 	if (dump_header_fields) {
-		int field_segy_offset, jjj;
-		char field_segy_type;
-		int m_field_nr = 1;
-		char m_field[1000], m_fields[1000], value[1000];
+		int k;
+		char value[1000];
 
 		printf("Segy header fields:\n");
-		while (get_field(header_fields_to_dump, m_field_nr, m_fields, ',')) {
-			if (m_field_nr > 1)
+		for (k = 0; k < num_header_fields_dump; k++) {
+			FIELD_SPEC *f = header_fields_dump + k;
+			if (k > 0)
 				printf("; ");
-			get_field(m_fields, 1, m_field, ':');
-			if (use_names)
-				jjj = get_parameter_index_by_offset(segy_header_types,
-						atoi(m_field));
-			field_segy_offset = atoi(m_field);
-			get_field(m_fields, 2, m_field, ':');
-			field_segy_type = m_field[0];
 			if (use_names)
-				printf("%s,%s", segy_header_names[jjj],
+				printf("%s,%s", segy_header_names[f->name_index],
 						get_str_val((unsigned char*) (&segy_file->header),
-								value, field_segy_offset, field_segy_type));
+								value, f->offset, f->type));
 			else
-				printf("%d,%c,%s", field_segy_offset, field_segy_type,
+				printf("%d,%c,%s", f->offset, f->type,
 						get_str_val((unsigned char*) (&segy_file->header),
-								value, field_segy_offset, field_segy_type));
-			m_field_nr++;
+								value, f->offset, f->type));
 		}
 
 		printf("\n");
@@ -1778,41 +3830,345 @@ int get_segy_header(SEGY_file *segy_file, int verbose) {
 	return 0;
 }
 
-/* check if the actual trace is inside the given ranges and fields_values.
+/* TRACE PREDICATE.
+ * -only_traces_with is compiled once into a tree of PRED_NODE, then
+ * evaluated straight on the big endian bytes of every trace header.
+ * The grammar is:
+ *
+ *   expr  := term { ("or" | "|") term }
+ *   term  := fact { ("and" | "&" | ",") fact }
+ *   fact  := ("not" | "!") fact | "(" expr ")" | field ["%" num] op
+ *   field := offset:type | parameter_name
+ *   op    := ("=" | ":" | "==" | "!=") list | ("<" | "<=" | ">" | ">=") num
+ *   list  := item | "{" item { "," item } "}"
+ *   item  := num [".." num]
+ *
+ * so the old offset:type:value,... and name:value,... lists still work.
  */
-bool keep_trace(SEGY_file *segy_file, int rec_start, int rec_end,
-		int trace_start, int trace_end, int trace_offset) {
-	int field_segy_offset;
-	char field_segy_type;
-	int m_field_nr = 1;
-	char m_field[1000], m_fields[1000], value[1000], expected_value[1000];
+enum {
+	PRED_TEST, PRED_AND, PRED_OR, PRED_NOT
+};
 
+typedef struct {
+	double lo, hi;
+} PRED_RANGE;
+
+typedef struct {
+	int kind;
+	int left, right; /* Operand nodes of PRED_AND, PRED_OR and PRED_NOT. */
+	int offset;
+	char type;
+	long modulus; /* The field is taken modulo this, when not 0. */
+	char op; /* '=', '!' (!=), '<', 'l' (<=), '>' or 'g' (>=). */
+	double value; /* For '<', 'l', '>' and 'g'. */
+	PRED_RANGE *ranges; /* For '=' and '!', sorted and merged. */
+	int num_ranges;
+} PRED_NODE;
+
+PRED_NODE *pred_nodes;
+int num_pred_nodes, pred_root;
+char *pred_str;
+int pred_pos;
+
+void pred_error(const char *msg) {
+	prerror_and_exit("Error: -only_traces_with %s at '%s'.\n", msg,
+			pred_str + pred_pos);
+}
+
+void pred_skip_blanks() {
+	while (isspace((unsigned char) pred_str[pred_pos]))
+		pred_pos++;
+}
+
+/* Skip the given word if it is next, as a whole word.
+ */
+bool pred_take_word(const char *word) {
+	int l = strlen(word);
+	pred_skip_blanks();
+	if (strncmp(pred_str + pred_pos, word, l) != 0
+			|| isalnum((unsigned char) pred_str[pred_pos + l])
+			|| pred_str[pred_pos + l] == '_')
+		return false;
+	pred_pos += l;
+	return true;
+}
+
+/* Skip the given symbol if it is next.
+ */
+bool pred_take(const char *sym) {
+	int l = strlen(sym);
+	pred_skip_blanks();
+	if (strncmp(pred_str + pred_pos, sym, l) != 0)
+		return false;
+	pred_pos += l;
+	return true;
+}
+
+double pred_number() {
+	char *end;
+	pred_skip_blanks();
+	double v = strtod(pred_str + pred_pos, &end);
+	if (end == pred_str + pred_pos)
+		pred_error("expects a number");
+	/* "100..200": strtod takes "100." */
+	if (end[-1] == '.' && end[0] == '.')
+		end--;
+	pred_pos = end - pred_str;
+	return v;
+}
+
+int pred_new_node(int kind) {
+	pred_nodes = (PRED_NODE *) realloc(pred_nodes,
+			(num_pred_nodes + 1) * sizeof(PRED_NODE));
+	if (pred_nodes == NULL)
+		prerror_and_exit("Error: Cannot allocate memory for -only_traces_with.\n");
+	memset(pred_nodes + num_pred_nodes, 0, sizeof(PRED_NODE));
+	pred_nodes[num_pred_nodes].kind = kind;
+	return num_pred_nodes++;
+}
+
+int compare_pred_ranges(const void *a, const void *b) {
+	double d = ((const PRED_RANGE *) a)->lo - ((const PRED_RANGE *) b)->lo;
+	return my_sgn(d);
+}
+
+void pred_value_list(PRED_NODE *n) {
+	bool braces = pred_take("{");
+	int k, m;
+
+	do {
+		n->ranges = (PRED_RANGE *) realloc(n->ranges,
+				(n->num_ranges + 1) * sizeof(PRED_RANGE));
+		if (n->ranges == NULL)
+			prerror_and_exit("Error: Cannot allocate memory for -only_traces_with.\n");
+		PRED_RANGE *r = n->ranges + n->num_ranges++;
+		r->lo = r->hi = pred_number();
+		if (pred_take(".."))
+			r->hi = pred_number();
+		if (r->hi < r->lo)
+			pred_error("has a range with the end before the start");
+	} while (braces && pred_take(","));
+	if (braces && !pred_take("}"))
+		pred_error("expects '}'");
+
+	/* Sort and merge the ranges for the binary search.
+	 */
+	qsort(n->ranges, n->num_ranges, sizeof(PRED_RANGE), compare_pred_ranges);
+	for (k = 1, m = 0; k < n->num_ranges; k++) {
+		if (n->ranges[k].lo <= n->ranges[m].hi)
+			n->ranges[m].hi = my_max(n->ranges[m].hi, n->ranges[k].hi);
+		else
+			n->ranges[++m] = n->ranges[k];
+	}
+	n->num_ranges = m + 1;
+}
+
+int pred_test() {
+	int node = pred_new_node(PRED_TEST);
+	PRED_NODE *n;
+	int offset, p;
+	char type;
+
+	pred_skip_blanks();
+	if (isdigit((unsigned char) pred_str[pred_pos])) {
+		offset = (int) pred_number();
+		if (!pred_take(":"))
+			pred_error("expects offset:type");
+		type = pred_str[pred_pos];
+		if (type != 'S' && type != 'I' && type != 'F')
+			pred_error("expects the type S, I or F");
+		pred_pos++;
+	} else {
+		char name[256];
+		int l = 0;
+		while ((isalnum((unsigned char) pred_str[pred_pos])
+				|| pred_str[pred_pos] == '_') && l < 255)
+			name[l++] = pred_str[pred_pos++];
+		name[l] = 0;
+		if (l == 0)
+			pred_error("expects a field");
+		p = get_parameter_index_by_name(trace_header_names, name);
+		offset = trace_header_types[p * 2];
+		type = trace_header_types[p * 2 + 1];
+		if (type != 'S' && type != 'I' && type != 'F')
+			pred_error("cannot test an unassigned field");
+	}
+	if (offset < 0 || offset + (type == 'S' ? 2 : 4) > 240)
+		prerror_and_exit("FATAL ERROR: field offset %d out of the header.\n",
+				offset);
+
+	n = pred_nodes + node;
+	n->offset = offset;
+	n->type = type;
+	if (pred_take("%")) {
+		n->modulus = (long) pred_number();
+		if (n->modulus <= 0)
+			pred_error("expects a modulus above 0");
+	}
+
+	if (pred_take("<="))
+		n->op = 'l';
+	else if (pred_take(">="))
+		n->op = 'g';
+	else if (pred_take("<"))
+		n->op = '<';
+	else if (pred_take(">"))
+		n->op = '>';
+	else if (pred_take("!="))
+		n->op = '!';
+	else if (pred_take("==") || pred_take("=") || pred_take(":"))
+		n->op = '=';
+	else
+		pred_error("expects one of = : == != < <= > >=");
+
+	if (n->op == '=' || n->op == '!')
+		pred_value_list(n);
+	else
+		n->value = pred_number();
+	return node;
+}
+
+int pred_expr();
+
+int pred_factor() {
+	int node;
+	if (pred_take_word("not") || pred_take("!")) {
+		int operand = pred_factor();
+		node = pred_new_node(PRED_NOT);
+		pred_nodes[node].left = operand;
+		return node;
+	}
+	if (pred_take("(")) {
+		node = pred_expr();
+		if (!pred_take(")"))
+			pred_error("expects ')'");
+		return node;
+	}
+	return pred_test();
+}
+
+int pred_term() {
+	int node = pred_factor();
+	while (pred_take_word("and") || pred_take("&") || pred_take(",")) {
+		int right = pred_factor();
+		int left = node;
+		node = pred_new_node(PRED_AND);
+		pred_nodes[node].left = left;
+		pred_nodes[node].right = right;
+	}
+	return node;
+}
+
+int pred_expr() {
+	int node = pred_term();
+	while (pred_take_word("or") || pred_take("|")) {
+		int right = pred_term();
+		int left = node;
+		node = pred_new_node(PRED_OR);
+		pred_nodes[node].left = left;
+		pred_nodes[node].right = right;
+	}
+	return node;
+}
+
+void compile_trace_predicate(char *str) {
+	pred_str = str;
+	pred_pos = 0;
+	num_pred_nodes = 0;
+	pred_root = pred_expr();
+	pred_skip_blanks();
+	if (pred_str[pred_pos] != 0)
+		pred_error("has unexpected text");
+}
+
+/* The value of a header field from its big endian bytes: floats go
+ * through the same "%f" text -dump_trace_fields prints.
+ */
+double pred_field_value(const unsigned char *h, PRED_NODE *n) {
+	const unsigned char *p = h + n->offset;
+	uint32_t w;
+	float f;
+	char value[100];
+
+	switch (n->type) {
+	case 'S':
+		return (int16_t) ((p[0] << 8) | p[1]);
+	case 'I':
+		return (int32_t) (((uint32_t) p[0] << 24) | (p[1] << 16) | (p[2] << 8)
+				| p[3]);
+	default:
+		w = ((uint32_t) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+		memcpy(&f, &w, 4);
+		sprintf(value, "%f", f);
+		return atof(value);
+	}
+}
+
+bool pred_in_ranges(PRED_NODE *n, double v) {
+	int lo = 0, hi = n->num_ranges - 1;
+	while (lo <= hi) {
+		int mid = (lo + hi) / 2;
+		if (v < n->ranges[mid].lo)
+			hi = mid - 1;
+		else if (v > n->ranges[mid].hi)
+			lo = mid + 1;
+		else
+			return true;
+	}
+	return false;
+}
+
+bool eval_trace_predicate(const unsigned char *h, int node) {
+	PRED_NODE *n = pred_nodes + node;
+	double v;
+
+	switch (n->kind) {
+	case PRED_AND:
+		return eval_trace_predicate(h, n->left)
+				&& eval_trace_predicate(h, n->right);
+	case PRED_OR:
+		return eval_trace_predicate(h, n->left)
+				|| eval_trace_predicate(h, n->right);
+	case PRED_NOT:
+		return !eval_trace_predicate(h, n->left);
+	}
+
+	v = pred_field_value(h, n);
+	if (n->modulus)
+		v = n->type == 'F' ? fmod(v, n->modulus) : (long) v % n->modulus;
+	switch (n->op) {
+	case '=':
+		return pred_in_ranges(n, v);
+	case '!':
+		return !pred_in_ranges(n, v);
+	case '<':
+		return v < n->value;
+	case 'l':
+		return v <= n->value;
+	case '>':
+		return v > n->value;
+	default:
+		return v >= n->value;
+	}
+}
+
+/* check if the actual trace is inside the given ranges and -only_traces_with.
+ */
+bool keep_trace(SEGY_file *segy_file, int rec_start, int rec_end,
+		int trace_start, int trace_end, int trace_offset) {
 	int tr_num = GET_SEGYTRACEH_Field(&segy_file->trace_header, trace_offset);
 	//tr_num =  GET_SEGYTRACEH_Trace_number_within_field_record(&segy_file->trace_header);
 	int sh_num = GET_SEGYTRACEH_Original_field_record_number(
 			&segy_file->trace_header);
 	if (tr_num >= trace_start && tr_num <= trace_end && sh_num >= rec_start
 			&& sh_num <= rec_end) {
-		if(only_traces_with)
-		{
-		while (get_field(traces_fields_valid_values, m_field_nr, m_fields, ',')) {
-			get_field(m_fields, 1, m_field, ':');
-			field_segy_offset = atoi(m_field);
-			get_field(m_fields, 2, m_field, ':');
-			field_segy_type = m_field[0];
-			get_field(m_fields, 3, expected_value, ':');
-			if (atof(get_str_val(segy_file->trace_header.HEADER, value,
-							field_segy_offset, field_segy_type))
-					!= atof(expected_value))
-			{
-				if(verbose >= 2) fprintf(stderr, "Discarding trace #%d of record #%d because it contains %f and not %f.\n",
-   					tr_num, sh_num,
-						atof(get_str_val(segy_file->trace_header.HEADER, value,	field_segy_offset, field_segy_type))
-					    , atof(expected_value));
-				return false;
-			}
-			m_field_nr++;
-		}
+		if (only_traces_with
+				&& !eval_trace_predicate(segy_file->trace_header.HEADER,
+						pred_root)) {
+			if (verbose >= 2)
+				fprintf(stderr, "Discarding trace #%d of record #%d because of -only_traces_with.\n",
+						tr_num, sh_num);
+			return false;
 		}
 		return true;
 	}
@@ -1834,14 +4190,855 @@ void do_skip_ntraces() {
 		nn *= 4;
 	else
 		prerror_and_exit("Error: Unknown data sample format code\n");
-	fseek(segy_file.fp, (240 + nn) * skip_ntraces, SEEK_CUR);
+	segy_seek(&segy_file, (240 + nn) * skip_ntraces, SEEK_CUR);
 }
 
-int get_segy_trace(SEGY_file *segy_file, int verbose) {
-	int i;
+/* TRACE INDEX.
+ * A sidecar file (input_file.idx) holding, for every trace, its offset
+ * into the file and the fields used to select it, so that -record and
+ * -trace can seek straight to the wanted traces.
+ */
+#define TRACE_INDEX_MAGIC "SEGYIDX1"
+#define TRACE_INDEX_BYTE_ORDER 0x01020304
+
+typedef struct {
+	char magic[8];
+	int32_t byte_order; /* TRACE_INDEX_BYTE_ORDER as written by the host. */
+	int32_t flipped; /* Built with -flip_endianess. */
+	int64_t file_size, file_mtime; /* Of the indexed file. */
+	int64_t num_traces;
+} TRACE_INDEX_HEADER;
+
+typedef struct {
+	int64_t offset;
+	int32_t record, trace, seq, num_samples;
+} TRACE_INDEX_ENTRY;
 
+TRACE_INDEX_ENTRY *trace_index;
+long trace_index_len, trace_index_size;
+
+/* Offsets of the traces to read, in order, instead of reading the whole
+ * file. NULL to read the file sequentially.
+ */
+off_t *visit_offsets;
+long num_visits, next_visit;
+
+char *sidecar_file_name(const char *fname, const char *ext) {
+	char *name = (char *) malloc(strlen(fname) + strlen(ext) + 1);
+	strcpy(name, fname);
+	strcat(name, ext);
+	return name;
+}
+
+void add_trace_index_entry(SEGY_file *segy_file) {
+	if (trace_index_len == trace_index_size) {
+		trace_index_size = trace_index_size ? trace_index_size * 2 : 4096;
+		trace_index = (TRACE_INDEX_ENTRY *) realloc(trace_index,
+				trace_index_size * sizeof(TRACE_INDEX_ENTRY));
+		if (trace_index == NULL)
+			prerror_and_exit("Error: Cannot allocate memory for the trace index.\n");
+	}
+	TRACE_INDEX_ENTRY *e = trace_index + trace_index_len++;
+	e->offset = segy_file->trace_pos;
+	e->record = GET_SEGYTRACEH_Original_field_record_number(
+			&segy_file->trace_header);
+	e->trace = GET_SEGYTRACEH_Trace_number_within_field_record(
+			&segy_file->trace_header);
+	e->seq = GET_SEGYTRACEH_Trace_sequence_number_within_reel(
+			&segy_file->trace_header);
+	e->num_samples = n_samples;
+}
+
+void fill_trace_index_header(SEGY_file *segy_file, TRACE_INDEX_HEADER *h) {
+	struct stat st;
+	memset(h, 0, sizeof(*h));
+	memcpy(h->magic, TRACE_INDEX_MAGIC, 8);
+	h->byte_order = TRACE_INDEX_BYTE_ORDER;
+	h->flipped = flip_endianess;
+	if (fstat(fileno(segy_file->fp), &st) == 0) {
+		h->file_size = st.st_size;
+		h->file_mtime = st.st_mtime;
+	}
+}
+
+void write_trace_index(SEGY_file *segy_file) {
+	TRACE_INDEX_HEADER h;
+	char *name = sidecar_file_name(segy_file->fname, ".idx");
+	FILE *fp = fopen(name, "wb");
+	if (fp == NULL)
+		prerror_and_exit("Cannot open '%s' file, aborting.\n", name);
+
+	fill_trace_index_header(segy_file, &h);
+	h.num_traces = trace_index_len;
+	if (fwrite(&h, sizeof(h), 1, fp) != 1
+			|| fwrite(trace_index, sizeof(TRACE_INDEX_ENTRY), trace_index_len,
+					fp) != (size_t) trace_index_len)
+		prerror_and_exit("Error while writing '%s'.\n", name);
+	fclose(fp);
+	if (verbose >= 1)
+		fprintf(stderr, "%ld traces written to '%s' index.\n",
+				trace_index_len, name);
+	free(name);
+}
+
+/* Load the trace index of the input file, if present and up to date.
+ * RETURN: 0 ON SUCCESS, -1 OTHERWISE.
+ */
+int read_trace_index(SEGY_file *segy_file) {
+	TRACE_INDEX_HEADER h, expected;
+	char *name = sidecar_file_name(segy_file->fname, ".idx");
+	FILE *fp = fopen(name, "rb");
+	free(name);
+	if (fp == NULL)
+		return -1;
+
+	fill_trace_index_header(segy_file, &expected);
+	if (fread(&h, sizeof(h), 1, fp) != 1 || memcmp(h.magic, expected.magic, 8)
+			|| h.byte_order != expected.byte_order
+			|| h.flipped != expected.flipped
+			|| h.file_size != expected.file_size
+			|| h.file_mtime != expected.file_mtime) {
+		if (verbose >= 1)
+			fprintf(stderr, "The trace index of '%s' is out of date, ignoring it.\n",
+					segy_file->fname);
+		fclose(fp);
+		return -1;
+	}
+
+	trace_index = (TRACE_INDEX_ENTRY *) malloc(
+			(h.num_traces + 1) * sizeof(TRACE_INDEX_ENTRY));
+	if (trace_index == NULL)
+		prerror_and_exit("Error: Cannot allocate memory for the trace index.\n");
+	trace_index_len = fread(trace_index, sizeof(TRACE_INDEX_ENTRY),
+			h.num_traces, fp);
+	fclose(fp);
+	if (trace_index_len != h.num_traces) {
+		free(trace_index);
+		trace_index = NULL;
+		trace_index_len = 0;
+		return -1;
+	}
+	return 0;
+}
+
+/* Use the trace index, when available, to visit only the traces inside
+ * the -record and -trace intervals.
+ */
+void select_traces_from_index(SEGY_file *segy_file) {
+	long j;
+
+	if (all_file || build_index || build_key_index || build_xy_index
+			|| segy_file->fp == stdin || scan
+			|| visit_offsets != NULL || dump_fields || skip_ntraces != 0 || only_ntraces != -1
+			|| trace_offset != 12)
+		return;
+	if (read_trace_index(segy_file))
+		return;
+
+	visit_offsets = (off_t *) malloc((trace_index_len + 1) * sizeof(off_t));
+	num_visits = next_visit = 0;
+	for (j = 0; j < trace_index_len; j++) {
+		TRACE_INDEX_ENTRY *e = trace_index + j;
+		if (e->trace >= trace_start && e->trace <= trace_end
+				&& e->record >= rec_start && e->record <= rec_end)
+			visit_offsets[num_visits++] = e->offset;
+	}
+
+	if (verbose >= 1)
+		fprintf(stderr, "Trace index: %ld of %ld traces selected.\n",
+				num_visits, trace_index_len);
+}
+
+/* KEY INDEX.
+ * A sidecar file (input_file.kidx) holding the offset of every trace
+ * sorted by up to MAX_INDEX_KEYS trace header fields, for example CDP
+ * and offset, so that -key_range reads only the traces inside the given
+ * key intervals, in key order, without sorting or rewriting the file.
+ */
+#define KEY_INDEX_MAGIC "SEGYKEY1"
+#define MAX_INDEX_KEYS 4
+
+typedef struct {
+	TRACE_INDEX_HEADER file; /* With KEY_INDEX_MAGIC. */
+	int32_t num_keys;
+	int32_t key_offset[MAX_INDEX_KEYS];
+	char key_type[MAX_INDEX_KEYS];
+} KEY_INDEX_HEADER;
+
+typedef struct {
+	int64_t offset;
+	double key[MAX_INDEX_KEYS];
+} KEY_INDEX_ENTRY;
+
+FIELD_SPEC index_keys[MAX_INDEX_KEYS];
+int num_index_keys;
+KEY_INDEX_ENTRY *key_index;
+long key_index_len, key_index_size;
+double key_range_min[MAX_INDEX_KEYS], key_range_max[MAX_INDEX_KEYS];
+int num_key_ranges;
+
+/* Parse the keys of -build_key_index, given by name or as offset:type.
+ */
+void parse_index_keys(char *str) {
+	char m_field[1000];
+	int m_field_nr = 1, p;
+
+	while (get_field(str, m_field_nr++, m_field, ',')) {
+		if (num_index_keys == MAX_INDEX_KEYS)
+			prerror_and_exit("-build_key_index: at most %d keys.\n",
+					MAX_INDEX_KEYS);
+		FIELD_SPEC *f = index_keys + num_index_keys++;
+		memset(f, 0, sizeof(*f));
+		trim(m_field);
+		char *colon = strchr(m_field, ':');
+		if (isdigit((unsigned char) m_field[0]) && colon != NULL) {
+			f->offset = atoi(m_field);
+			f->type = colon[1];
+		} else {
+			p = get_parameter_index_by_name(trace_header_names, m_field);
+			f->offset = trace_header_types[p * 2];
+			f->type = trace_header_types[p * 2 + 1];
+		}
+		if (f->type != 'S' && f->type != 'I' && f->type != 'F')
+			prerror_and_exit("-build_key_index: unknown type of '%s'.\n",
+					m_field);
+		if (f->offset < 0 || f->offset + (f->type == 'S' ? 2 : 4) > 240)
+			prerror_and_exit("FATAL ERROR: field offset %d out of the header.\n",
+					f->offset);
+	}
+	if (num_index_keys == 0)
+		prerror_and_exit("-build_key_index needs at least one key.\n");
+}
+
+/* Parse the min,max pairs of -key_range, one for each of the first keys.
+ */
+void parse_key_ranges(char *str) {
+	char m_field[1000];
+	int m_field_nr = 1;
+
+	while (get_field(str, m_field_nr, m_field, ',')) {
+		if (num_key_ranges == MAX_INDEX_KEYS)
+			prerror_and_exit("-key_range: at most %d intervals.\n",
+					MAX_INDEX_KEYS);
+		key_range_min[num_key_ranges] = atof(m_field);
+		if (!get_field(str, m_field_nr + 1, m_field, ','))
+			prerror_and_exit("-key_range: the last interval has no max.\n");
+		key_range_max[num_key_ranges++] = atof(m_field);
+		m_field_nr += 2;
+	}
+	if (num_key_ranges == 0)
+		prerror_and_exit("-key_range needs at least one interval.\n");
+}
+
+void add_key_index_entry(SEGY_file *segy_file) {
+	int k;
+	if (key_index_len == key_index_size) {
+		key_index_size = key_index_size ? key_index_size * 2 : 4096;
+		key_index = (KEY_INDEX_ENTRY *) realloc(key_index,
+				key_index_size * sizeof(KEY_INDEX_ENTRY));
+		if (key_index == NULL)
+			prerror_and_exit("Error: Cannot allocate memory for the key index.\n");
+	}
+	KEY_INDEX_ENTRY *e = key_index + key_index_len++;
+	memset(e, 0, sizeof(*e));
+	e->offset = segy_file->trace_pos;
+	for (k = 0; k < num_index_keys; k++)
+		e->key[k] = get_field_value(segy_file->trace_header.HEADER,
+				index_keys + k);
+}
+
+/* By keys, then by position into the file.
+ */
+int compare_key_index_entries(const void *a, const void *b) {
+	const KEY_INDEX_ENTRY *ea = a, *eb = b;
+	int k;
+	for (k = 0; k < MAX_INDEX_KEYS; k++)
+		if (ea->key[k] != eb->key[k])
+			return ea->key[k] < eb->key[k] ? -1 : 1;
+	return (ea->offset > eb->offset) - (ea->offset < eb->offset);
+}
+
+void fill_key_index_header(SEGY_file *segy_file, KEY_INDEX_HEADER *h) {
+	memset(h, 0, sizeof(*h));
+	fill_trace_index_header(segy_file, &h->file);
+	memcpy(h->file.magic, KEY_INDEX_MAGIC, 8);
+}
+
+void write_key_index(SEGY_file *segy_file) {
+	KEY_INDEX_HEADER h;
+	int k;
+	char *name = sidecar_file_name(segy_file->fname, ".kidx");
+	FILE *fp = fopen(name, "wb");
+	if (fp == NULL)
+		prerror_and_exit("Cannot open '%s' file, aborting.\n", name);
+
+	qsort(key_index, key_index_len, sizeof(KEY_INDEX_ENTRY),
+			compare_key_index_entries);
+	fill_key_index_header(segy_file, &h);
+	h.file.num_traces = key_index_len;
+	h.num_keys = num_index_keys;
+	for (k = 0; k < num_index_keys; k++) {
+		h.key_offset[k] = index_keys[k].offset;
+		h.key_type[k] = index_keys[k].type;
+	}
+	if (fwrite(&h, sizeof(h), 1, fp) != 1
+			|| fwrite(key_index, sizeof(KEY_INDEX_ENTRY), key_index_len, fp)
+					!= (size_t) key_index_len)
+		prerror_and_exit("Error while writing '%s'.\n", name);
+	fclose(fp);
+	if (verbose >= 1)
+		fprintf(stderr, "%ld traces written to '%s' key index.\n",
+				key_index_len, name);
+	free(name);
+}
+
+/* Visit, in key order, the traces of the key index whose keys are inside
+ * the -key_range intervals.
+ */
+void select_traces_by_key(SEGY_file *segy_file) {
+	KEY_INDEX_HEADER h, expected;
+	long j, lo, hi;
+	int k;
+
+	if (num_key_ranges == 0)
+		return;
+	char *name = sidecar_file_name(segy_file->fname, ".kidx");
+	FILE *fp = fopen(name, "rb");
+	fill_key_index_header(segy_file, &expected);
+	if (fp == NULL || fread(&h, sizeof(h), 1, fp) != 1
+			|| memcmp(h.file.magic, expected.file.magic, 8)
+			|| h.file.byte_order != expected.file.byte_order
+			|| h.file.flipped != expected.file.flipped
+			|| h.file.file_size != expected.file.file_size
+			|| h.file.file_mtime != expected.file.file_mtime)
+		prerror_and_exit("Error: -key_range needs an up to date '%s', make it with -build_key_index.\n",
+				name);
+	if (num_key_ranges > h.num_keys)
+		prerror_and_exit("Error: '%s' has %d keys, %d intervals given.\n",
+				name, h.num_keys, num_key_ranges);
+
+	key_index = (KEY_INDEX_ENTRY *) malloc(
+			(h.file.num_traces + 1) * sizeof(KEY_INDEX_ENTRY));
+	if (key_index == NULL)
+		prerror_and_exit("Error: Cannot allocate memory for the key index.\n");
+	key_index_len = fread(key_index, sizeof(KEY_INDEX_ENTRY),
+			h.file.num_traces, fp);
+	fclose(fp);
+	if (key_index_len != h.file.num_traces)
+		prerror_and_exit("Error while reading '%s'.\n", name);
+
+	/* First entry with the first key not below its min.
+	 */
+	lo = 0;
+	hi = key_index_len;
+	while (lo < hi) {
+		long mid = lo + (hi - lo) / 2;
+		if (key_index[mid].key[0] < key_range_min[0])
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	visit_offsets = (off_t *) malloc((key_index_len + 1) * sizeof(off_t));
+	if (visit_offsets == NULL)
+		prerror_and_exit("Error: Cannot allocate memory for the key index.\n");
+	num_visits = next_visit = 0;
+	for (j = lo; j < key_index_len && key_index[j].key[0] <= key_range_max[0];
+			j++) {
+		for (k = 1; k < num_key_ranges; k++)
+			if (key_index[j].key[k] < key_range_min[k]
+					|| key_index[j].key[k] > key_range_max[k])
+				break;
+		if (k == num_key_ranges)
+			visit_offsets[num_visits++] = key_index[j].offset;
+	}
+
+	if (verbose >= 1)
+		fprintf(stderr, "Key index: %ld of %ld traces selected.\n",
+				num_visits, key_index_len);
+	free(name);
+}
+
+/* XY INDEX.
+ * A sidecar file (input_file.sxy for the source positions, input_file.rxy
+ * for the receiver ones) holding the offset and position of every trace
+ * bucketed in a uniform grid, shaped after the x and y extent, of about
+ * XY_INDEX_CELL_TRACES traces per cell, so that -xy_box and -xy_polygon
+ * read from the index only the cells crossing the wanted area and from
+ * the SEGY file only the traces inside it. Traces without a finite
+ * position are left out.
+ */
+#define XY_INDEX_MAGIC "SEGYXYI1"
+#define XY_INDEX_CELL_TRACES 16
+#define XY_INDEX_MAX_CELLS 4096 /* Along each side. */
+
+typedef struct {
+	TRACE_INDEX_HEADER file; /* With XY_INDEX_MAGIC. */
+	int32_t source_1_or_receiver_2;
+	int32_t nx, ny;
+	double min_x, min_y, cell_x, cell_y;
+} XY_INDEX_HEADER;
+
+/* The header is followed by the nx * ny + 1 int64 cell starts, cell
+ * (cx, cy) being number cy * nx + cx, then by the entries of every cell
+ * in file order.
+ */
+typedef struct {
+	int64_t offset;
+	double x, y;
+} XY_INDEX_ENTRY;
+
+XY_INDEX_ENTRY *xy_index;
+long xy_index_len, xy_index_size;
+int xy_query; /* 1 source, 2 receiver, 0 none. */
+double xy_query_box[4]; /* min x, min y, max x, max y. */
+double *xy_polygon; /* x, y of each vertex, NULL for a box. */
+int xy_polygon_len;
+
+int parse_xy_kind(char *str, char *option) {
+	if (strcmp(str, "SOURCE") == 0)
+		return 1;
+	if (strcmp(str, "RECEIVER") == 0)
+		return 2;
+	prerror_and_exit("either SOURCE or RECEIVER must be given with the switch %s.\n",
+			option);
+	return 0;
+}
+
+char *xy_index_file_name(const char *fname, int source_1_or_receiver_2) {
+	return sidecar_file_name(fname, source_1_or_receiver_2 == 1 ? ".sxy" : ".rxy");
+}
+
+/* Parse SOURCE|RECEIVER,x1,y1,x2,y2[,...] of -xy_box and -xy_polygon, a
+ * box is given by two corners.
+ */
+void parse_xy_query(char *str, char *option, bool box) {
+	char m_field[1000];
+	int m_field_nr = 2, n = 0, k;
+	double *v = NULL;
+
+	get_field(str, 1, m_field, ',');
+	xy_query = parse_xy_kind(m_field, option);
+	while (get_field(str, m_field_nr++, m_field, ',')) {
+		v = (double *) realloc(v, (n + 1) * sizeof(double));
+		if (v == NULL)
+			prerror_and_exit("Error: Cannot allocate memory for %s.\n", option);
+		v[n++] = atof(m_field);
+	}
+	if (n % 2 != 0 || (box && n != 4) || (!box && n < 6))
+		prerror_and_exit(box ? "%s needs SOURCE|RECEIVER,xmin,ymin,xmax,ymax.\n"
+				: "%s needs SOURCE|RECEIVER and at least three x,y vertices.\n",
+				option);
+
+	xy_query_box[0] = xy_query_box[2] = v[0];
+	xy_query_box[1] = xy_query_box[3] = v[1];
+	for (k = 2; k < n; k += 2) {
+		xy_query_box[0] = my_min(xy_query_box[0], v[k]);
+		xy_query_box[1] = my_min(xy_query_box[1], v[k + 1]);
+		xy_query_box[2] = my_max(xy_query_box[2], v[k]);
+		xy_query_box[3] = my_max(xy_query_box[3], v[k + 1]);
+	}
+	if (box)
+		free(v);
+	else {
+		xy_polygon = v;
+		xy_polygon_len = n / 2;
+	}
+}
+
+/* Even-odd rule, a point on an edge may fall either side.
+ */
+bool inside_xy_polygon(double x, double y) {
+	int j, k;
+	bool in = false;
+	for (j = 0, k = xy_polygon_len - 1; j < xy_polygon_len; k = j++) {
+		double xj = xy_polygon[2 * j], yj = xy_polygon[2 * j + 1];
+		double xk = xy_polygon[2 * k], yk = xy_polygon[2 * k + 1];
+		if ((yj > y) != (yk > y) && x < (xk - xj) * (y - yj) / (yk - yj) + xj)
+			in = !in;
+	}
+	return in;
+}
+
+void add_xy_index_entry(SEGY_file *segy_file) {
+	int uom;
+	if (xy_index_len == xy_index_size) {
+		xy_index_size = xy_index_size ? xy_index_size * 2 : 4096;
+		xy_index = (XY_INDEX_ENTRY *) realloc(xy_index,
+				xy_index_size * sizeof(XY_INDEX_ENTRY));
+		if (xy_index == NULL)
+			prerror_and_exit("Error: Cannot allocate memory for the xy index.\n");
+	}
+	XY_INDEX_ENTRY *e = xy_index + xy_index_len++;
+	e->offset = segy_file->trace_pos;
+	if (build_xy_index == 1)
+		get_source_xy(segy_file, &e->x, &e->y, &uom);
+	else
+		get_receiver_xy(segy_file, &e->x, &e->y, &uom);
+	/* A trace without a position cannot fall inside any area.
+	 */
+	if (!isfinite(e->x) || !isfinite(e->y))
+		xy_index_len--;
+}
+
+void fill_xy_index_header(SEGY_file *segy_file, XY_INDEX_HEADER *h) {
+	memset(h, 0, sizeof(*h));
+	fill_trace_index_header(segy_file, &h->file);
+	memcpy(h->file.magic, XY_INDEX_MAGIC, 8);
+}
+
+int xy_index_cell(XY_INDEX_HEADER *h, double v, bool along_y) {
+	double c = along_y ? (v - h->min_y) / h->cell_y : (v - h->min_x) / h->cell_x;
+	int n = along_y ? h->ny : h->nx;
+	if (!(c >= 0))
+		return 0;
+	return c >= n ? n - 1 : (int) c;
+}
+
+/* Split the xy_index_len / XY_INDEX_CELL_TRACES cells between the two
+ * sides in the ratio of the x and y extents, so that a long and narrow
+ * survey gets long and narrow rows of cells rather than a few crowded
+ * ones.
+ */
+void set_xy_index_grid(XY_INDEX_HEADER *h, double width, double height) {
+	double num_cells = my_max(1.0, (double) xy_index_len / XY_INDEX_CELL_TRACES);
+	double nx = width <= 0 ? 1 : height <= 0 ? num_cells
+			: sqrt(num_cells * width / height);
+	h->nx = (int) my_max(1.0, my_min((double) XY_INDEX_MAX_CELLS, round(nx)));
+	h->ny = (int) my_max(1.0, my_min((double) XY_INDEX_MAX_CELLS,
+			round(num_cells / h->nx)));
+}
+
+void write_xy_index(SEGY_file *segy_file) {
+	XY_INDEX_HEADER h;
+	long j;
+	double max_x = -INFINITY, max_y = -INFINITY;
+	char *name = xy_index_file_name(segy_file->fname, build_xy_index);
+	FILE *fp = fopen(name, "wb");
+	if (fp == NULL)
+		prerror_and_exit("Cannot open '%s' file, aborting.\n", name);
+
+	fill_xy_index_header(segy_file, &h);
+	h.file.num_traces = xy_index_len;
+	h.source_1_or_receiver_2 = build_xy_index;
+	h.min_x = h.min_y = INFINITY;
+	for (j = 0; j < xy_index_len; j++) {
+		h.min_x = my_min(h.min_x, xy_index[j].x);
+		h.min_y = my_min(h.min_y, xy_index[j].y);
+		max_x = my_max(max_x, xy_index[j].x);
+		max_y = my_max(max_y, xy_index[j].y);
+	}
+	if (xy_index_len == 0)
+		h.min_x = h.min_y = max_x = max_y = 0;
+	set_xy_index_grid(&h, max_x - h.min_x, max_y - h.min_y);
+	h.cell_x = max_x > h.min_x ? (max_x - h.min_x) / h.nx : 1;
+	h.cell_y = max_y > h.min_y ? (max_y - h.min_y) / h.ny : 1;
+
+	/* Counting sort by cell, the entries of a cell stay in file order.
+	 */
+	long num_cells = (long) h.nx * h.ny;
+	int64_t *starts = (int64_t *) calloc(num_cells + 1, sizeof(int64_t));
+	int *cells = (int *) malloc((xy_index_len + 1) * sizeof(int));
+	XY_INDEX_ENTRY *sorted = (XY_INDEX_ENTRY *) malloc(
+			(xy_index_len + 1) * sizeof(XY_INDEX_ENTRY));
+	if (starts == NULL || cells == NULL || sorted == NULL)
+		prerror_and_exit("Error: Cannot allocate memory for the xy index.\n");
+	for (j = 0; j < xy_index_len; j++) {
+		cells[j] = xy_index_cell(&h, xy_index[j].y, true) * h.nx
+				+ xy_index_cell(&h, xy_index[j].x, false);
+		starts[cells[j] + 1]++;
+	}
+	for (j = 0; j < num_cells; j++)
+		starts[j + 1] += starts[j];
+	for (j = 0; j < xy_index_len; j++)
+		sorted[starts[cells[j]]++] = xy_index[j];
+	for (j = num_cells; j > 0; j--)
+		starts[j] = starts[j - 1];
+	starts[0] = 0;
+
+	if (fwrite(&h, sizeof(h), 1, fp) != 1
+			|| fwrite(starts, sizeof(int64_t), num_cells + 1, fp)
+					!= (size_t) num_cells + 1
+			|| fwrite(sorted, sizeof(XY_INDEX_ENTRY), xy_index_len, fp)
+					!= (size_t) xy_index_len)
+		prerror_and_exit("Error while writing '%s'.\n", name);
+	fclose(fp);
+	if (verbose >= 1)
+		fprintf(stderr, "%ld traces written to '%s' xy index, %d x %d cells.\n",
+				xy_index_len, name, h.nx, h.ny);
+	free(starts);
+	free(cells);
+	free(sorted);
+	free(name);
+}
+
+int compare_offsets(const void *a, const void *b) {
+	off_t oa = *(const off_t *) a, ob = *(const off_t *) b;
+	return (oa > ob) - (oa < ob);
+}
+
+/* Visit, in file order, the traces of the xy index inside the -xy_box or
+ * -xy_polygon area, reading from the index only the rows of cells
+ * crossing it.
+ */
+void select_traces_by_xy(SEGY_file *segy_file) {
+	XY_INDEX_HEADER h, expected;
+	long j, num_cells, buf_size = 0;
+	int cx0, cx1, cy;
+	XY_INDEX_ENTRY *buf = NULL;
+
+	if (xy_query == 0)
+		return;
+	char *name = xy_index_file_name(segy_file->fname, xy_query);
+	FILE *fp = fopen(name, "rb");
+	fill_xy_index_header(segy_file, &expected);
+	if (fp == NULL || fread(&h, sizeof(h), 1, fp) != 1
+			|| memcmp(h.file.magic, expected.file.magic, 8)
+			|| h.file.byte_order != expected.file.byte_order
+			|| h.file.flipped != expected.file.flipped
+			|| h.file.file_size != expected.file.file_size
+			|| h.file.file_mtime != expected.file.file_mtime)
+		prerror_and_exit("Error: -xy_box and -xy_polygon need an up to date '%s', make it with -build_xy_index.\n",
+				name);
+
+	num_cells = (long) h.nx * h.ny;
+	int64_t *starts = (int64_t *) malloc((num_cells + 1) * sizeof(int64_t));
+	if (starts == NULL)
+		prerror_and_exit("Error: Cannot allocate memory for the xy index.\n");
+	if (fread(starts, sizeof(int64_t), num_cells + 1, fp) != (size_t) num_cells + 1)
+		prerror_and_exit("Error while reading '%s'.\n", name);
+	off_t entries_pos = sizeof(h) + (num_cells + 1) * sizeof(int64_t);
+
+	visit_offsets = NULL;
+	num_visits = next_visit = 0;
+	long visits_size = 0;
+	cx0 = xy_index_cell(&h, xy_query_box[0], false);
+	cx1 = xy_index_cell(&h, xy_query_box[2], false);
+	for (cy = xy_index_cell(&h, xy_query_box[1], true);
+			cy <= xy_index_cell(&h, xy_query_box[3], true); cy++) {
+		long first = starts[(long) cy * h.nx + cx0];
+		long n = starts[(long) cy * h.nx + cx1 + 1] - first;
+		if (n == 0)
+			continue;
+		if (n > buf_size) {
+			buf_size = n;
+			buf = (XY_INDEX_ENTRY *) realloc(buf, n * sizeof(XY_INDEX_ENTRY));
+			if (buf == NULL)
+				prerror_and_exit("Error: Cannot allocate memory for the xy index.\n");
+		}
+		if (fseeko(fp, entries_pos + first * sizeof(XY_INDEX_ENTRY), SEEK_SET)
+				|| fread(buf, sizeof(XY_INDEX_ENTRY), n, fp) != (size_t) n)
+			prerror_and_exit("Error while reading '%s'.\n", name);
+		for (j = 0; j < n; j++) {
+			XY_INDEX_ENTRY *e = buf + j;
+			if (e->x < xy_query_box[0] || e->x > xy_query_box[2]
+					|| e->y < xy_query_box[1] || e->y > xy_query_box[3]
+					|| (xy_polygon != NULL && !inside_xy_polygon(e->x, e->y)))
+				continue;
+			if (num_visits == visits_size) {
+				visits_size = visits_size ? visits_size * 2 : 4096;
+				visit_offsets = (off_t *) realloc(visit_offsets,
+						visits_size * sizeof(off_t));
+				if (visit_offsets == NULL)
+					prerror_and_exit("Error: Cannot allocate memory for the xy index.\n");
+			}
+			visit_offsets[num_visits++] = e->offset;
+		}
+	}
+	fclose(fp);
+
+	/* An empty selection must still visit nothing, not the whole file.
+	 */
+	if (visit_offsets == NULL)
+		visit_offsets = (off_t *) malloc(sizeof(off_t));
+	qsort(visit_offsets, num_visits, sizeof(off_t), compare_offsets);
+
+	if (verbose >= 1)
+		fprintf(stderr, "XY index: %ld of %ld traces selected.\n",
+				num_visits, (long) h.file.num_traces);
+	free(starts);
+	free(buf);
+	free(name);
+}
+
+/* Move to the next trace to visit.
+ * RETURN: 0 WHEN THERE ARE NO MORE TRACES TO VISIT.
+ */
+int seek_next_visit(SEGY_file *segy_file) {
+	if (next_visit >= num_visits)
+		return 0;
+	segy_seek(segy_file, visit_offsets[next_visit++], SEEK_SET);
+	return 1;
+}
+
+/* READ-AHEAD THREAD.
+ * A reader thread fills a ring of prefetch_slots trace buffers while the
+ * main loop processes the traces already read, get_segy_trace() then
+ * just takes the next ready slot.
+ */
+typedef struct {
+	unsigned char header[240];
+	unsigned char *data;
+	size_t header_len, data_len, data_size;
+	off_t pos; /* Offset of the trace header. */
+} PREFETCH_SLOT;
+
+PREFETCH_SLOT *prefetch_ring, *prefetch_slot;
+long prefetch_produced, prefetch_taken, prefetch_released;
+bool prefetch_stop, prefetch_done;
+pthread_t prefetch_thread;
+pthread_mutex_t prefetch_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t prefetch_cond = PTHREAD_COND_INITIALIZER;
+
+/* Number of samples from a raw trace header, as stored into the file.
+ */
+int raw_number_of_samples(unsigned char *header) {
+	unsigned short ns;
+	if (flip_endianess)
+		ns = header[114] | (header[115] << 8);
+	else
+		ns = (header[114] << 8) | header[115];
+	return ns;
+}
+
+void *prefetch_reader(void *arg) {
+	SEGY_file *segy_file = (SEGY_file *) arg;
+	int sample_length = trace_sample_length(segy_file);
+	bool end = false;
+
+	/* Can be cancelled only while doing I/O, see stop_prefetch().
+	 */
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+	while (!end) {
+		pthread_mutex_lock(&prefetch_mutex);
+		while (prefetch_produced - prefetch_released == prefetch_slots
+				&& !prefetch_stop)
+			pthread_cond_wait(&prefetch_cond, &prefetch_mutex);
+		end = prefetch_stop;
+		pthread_mutex_unlock(&prefetch_mutex);
+		if (end)
+			break;
+
+		PREFETCH_SLOT *slot = prefetch_ring + prefetch_produced % prefetch_slots;
+		slot->header_len = slot->data_len = 0;
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+		if (visit_offsets != NULL) {
+			if (next_visit < num_visits)
+				fseeko(segy_file->fp, visit_offsets[next_visit++], SEEK_SET);
+			else
+				end = true;
+		}
+		slot->pos = ftello(segy_file->fp);
+		if (!end)
+			slot->header_len = fread(slot->header, 1, 240, segy_file->fp);
+		if (slot->header_len == 240) {
+			size_t len = (size_t) raw_number_of_samples(slot->header)
+					* sample_length;
+			if (header_only)
+				slot->data_len = skip_segy_bytes(segy_file, len);
+			else {
+				if (len > slot->data_size) {
+					slot->data = (unsigned char *) realloc(slot->data, len);
+					if (slot->data == NULL)
+						prerror_and_exit("Error: Cannot allocate memory for TRACE DATA.\n");
+					slot->data_size = len;
+				}
+				slot->data_len = fread(slot->data, 1, len, segy_file->fp);
+			}
+			if (slot->data_len != len)
+				end = true;
+		} else
+			end = true;
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+		pthread_mutex_lock(&prefetch_mutex);
+		prefetch_produced++;
+		prefetch_done = end;
+		pthread_cond_broadcast(&prefetch_cond);
+		pthread_mutex_unlock(&prefetch_mutex);
+	}
+	return NULL;
+}
+
+void start_prefetch(SEGY_file *segy_file) {
+	if (prefetch_slots <= 0)
+		return;
+	/* One slot is held by the trace being processed. */
+	if (prefetch_slots < 2)
+		prefetch_slots = 2;
+	prefetch_ring = (PREFETCH_SLOT *) calloc(prefetch_slots,
+			sizeof(PREFETCH_SLOT));
+	if (prefetch_ring == NULL)
+		prerror_and_exit("Error: Cannot allocate memory for the prefetch ring.\n");
+	prefetch_produced = prefetch_taken = prefetch_released = 0;
+	prefetch_stop = prefetch_done = false;
+	prefetch_pos = segy_tell(segy_file);
+	if (pthread_create(&prefetch_thread, NULL, prefetch_reader, segy_file))
+		prerror_and_exit("Error: Cannot start the prefetch thread.\n");
+	prefetch_active = true;
+}
+
+/* Release the slot of the previous trace and wait for the next one.
+ */
+PREFETCH_SLOT *take_prefetched_trace() {
+	PREFETCH_SLOT *slot;
+	pthread_mutex_lock(&prefetch_mutex);
+	prefetch_released = prefetch_taken;
+	pthread_cond_broadcast(&prefetch_cond);
+	while (prefetch_taken == prefetch_produced)
+		pthread_cond_wait(&prefetch_cond, &prefetch_mutex);
+	slot = prefetch_ring + prefetch_taken % prefetch_slots;
+	prefetch_taken++;
+	pthread_mutex_unlock(&prefetch_mutex);
+	prefetch_pos = slot->pos + slot->header_len + slot->data_len;
+	return slot;
+}
+
+void stop_prefetch() {
+	int j;
+	if (!prefetch_active)
+		return;
+	pthread_mutex_lock(&prefetch_mutex);
+	prefetch_stop = true;
+	if (!prefetch_done)
+		pthread_cancel(prefetch_thread); /* It may be blocked reading a pipe. */
+	pthread_cond_broadcast(&prefetch_cond);
+	pthread_mutex_unlock(&prefetch_mutex);
+	pthread_join(prefetch_thread, NULL);
+	for (j = 0; j < prefetch_slots; j++)
+		free(prefetch_ring[j].data);
+	free(prefetch_ring);
+	prefetch_active = false;
+}
+
+typedef struct {
+	SEGY_file in, out;
+	unsigned char *in_data; /* Copy of the input samples. */
+	size_t in_data_size;
+} WORKER_TRACE;
+
+WORKER_TRACE *worker_traces;
+int worker_traces_len, worker_traces_size, num_threads;
+
+/* RETURN: TRUE WHEN get_segy_trace DECODES THE SAMPLES OF EVERY TRACE.
+ */
+bool decode_trace_samples() {
+	return dump || plot_data || scan || qc || apply_correction || enable_X11;
+}
+
+int get_segy_trace(SEGY_file *segy_file, int verbose) {
 	int bytes_read;
-	bytes_read = fread(&segy_file->trace_header, 1, 240, segy_file->fp);
+	if (prefetch_active) {
+		prefetch_slot = take_prefetched_trace();
+		segy_file->trace_pos = prefetch_slot->pos;
+		bytes_read = prefetch_slot->header_len;
+		memcpy(&segy_file->trace_header, prefetch_slot->header, bytes_read);
+		if (bytes_read != 240)
+			segy_file->at_eof = true;
+	} else {
+		segy_file->trace_pos = segy_tell(segy_file);
+		bytes_read = read_segy_bytes(segy_file, &segy_file->trace_header, 240);
+	}
 	if (bytes_read == 0)
 		return 0;
 
@@ -1854,6 +5051,8 @@ int get_segy_trace(SEGY_file *segy_file, int verbose) {
 	}
 
 	flip_trace_header_endianess(segy_file);
+	segy_file->keep = keep_trace(segy_file, rec_start, rec_end, trace_start,
+			trace_end, trace_offset);
 
 	n_samples = GET_SEGYTRACEH_Number_of_samples_in_this_trace(
 				&segy_file->trace_header);
@@ -1878,9 +5077,8 @@ int get_segy_trace(SEGY_file *segy_file, int verbose) {
 	long tr_nr_in_line = GET_SEGYTRACEH_Trace_sequence_number_within_line(&segy_file->trace_header);
 	long sample_interval = GET_SEGYTRACEH_Sample_interval(&segy_file->trace_header);
 
-	if ((verbose == 2 || verbose == 3) && !feof(segy_file->fp)
-			&& keep_trace(segy_file, rec_start, rec_end, trace_start,
-					trace_end, trace_offset)) {
+	if ((verbose == 2 || verbose == 3) && !segy_eof(segy_file)
+			&& segy_file->keep) {
 		printf("--------------------------- TRACE HEADER ------------------\n");
 		printf("Original field record number : %ld\n", record_nr);
 		printf("Trace number within field record: %ld\n", tr_nr_in_record);
@@ -1890,19 +5088,60 @@ int get_segy_trace(SEGY_file *segy_file, int verbose) {
 		printf("Sample interval (microseconds) : %ld\n", sample_interval);
 	}
 
-	segy_file->trace_data = (unsigned char *) realloc(segy_file->trace_data,
-			trace_data_length(segy_file));
 	segy_file->trace_data_double = (double *) realloc(
 			segy_file->trace_data_double, n_samples * sizeof(double));
 
-	if ((bytes_read = fread(segy_file->trace_data, trace_data_length(segy_file),
-			1, segy_file->fp)) != 1) {
-		printf(
-				"Fatal error: End of file found too early, cannot read the trace data.\n");
-		return 1;
+	/* When the samples are not going to be changed in place, use
+	 * them straight from the memory map without copying.
+	 */
+	if (prefetch_active) {
+		segy_file->trace_data = prefetch_slot->data;
+		if (prefetch_slot->data_len != (size_t) trace_data_length(segy_file)) {
+			segy_file->at_eof = true;
+			printf(
+					"Fatal error: End of file found too early, cannot read the trace data.\n");
+			return 1;
+		}
+	} else if (header_only) {
+		segy_file->trace_data = NULL;
+		if (skip_segy_bytes(segy_file, trace_data_length(segy_file))
+				!= (size_t) trace_data_length(segy_file)) {
+			printf(
+					"Fatal error: End of file found too early, cannot read the trace data.\n");
+			return 1;
+		}
+	} else if (segy_file->map != NULL && !flip_endianess && skip_nsamples == -1
+			&& only_nsamples == -1) {
+		segy_file->trace_data = map_segy_bytes(segy_file,
+				trace_data_length(segy_file));
+		if (segy_file->trace_data == NULL) {
+			printf(
+					"Fatal error: End of file found too early, cannot read the trace data.\n");
+			return 1;
+		}
+	} else {
+		segy_file->trace_buffer = (unsigned char *) realloc(
+				segy_file->trace_buffer, trace_data_length(segy_file));
+		segy_file->trace_data = segy_file->trace_buffer;
+
+		if (read_segy_bytes(segy_file, segy_file->trace_data,
+				trace_data_length(segy_file))
+				!= (size_t) trace_data_length(segy_file)) {
+			printf(
+					"Fatal error: End of file found too early, cannot read the trace data.\n");
+			return 1;
+		}
 	}
 
-	flip_trace_data_endianess(segy_file);
+	if (!header_only)
+		flip_trace_data_endianess(segy_file);
+
+	if (build_index)
+		add_trace_index_entry(segy_file);
+	if (build_key_index)
+		add_key_index_entry(segy_file);
+	if (build_xy_index)
+		add_xy_index_entry(segy_file);
 
 	/* skip_n_samples....
 	 */
@@ -1931,14 +5170,18 @@ int get_segy_trace(SEGY_file *segy_file, int verbose) {
 		set_short(ns, (void*)(&segy_file->trace_header) + 114);
 		set_short((skip_nsamples * sample_interval) / 1000 + get_short((void*)(&segy_file->trace_header) + 108), (void*)(&segy_file->trace_header) + 108);
 		n_samples = ns;
+
+		/* The selection sees the trimmed header, as the output does.
+		 */
+		segy_file->keep = keep_trace(segy_file, rec_start, rec_end,
+				trace_start, trace_end, trace_offset);
 	}
 	delay_time = GET_SEGYTRACEH_Delay_time_between_source_and_recording_time(&segy_file->trace_header);
 
-	if (verbose == 2 && keep_trace(segy_file, rec_start, rec_end, trace_start, trace_end, trace_offset))
+	if (verbose == 2 && segy_file->keep)
 		printf("Rec/Seq/Num = %ld/%ld/%ld\n", record_nr, tr_nr_in_reel, tr_nr_in_record);
 
-	if (print_rec_seq_num &&
-			keep_trace(segy_file, rec_start, rec_end, trace_start,	trace_end, trace_offset))
+	if (print_rec_seq_num && segy_file->keep)
 		printf("%ld %ld %ld\n", record_nr, tr_nr_in_reel, tr_nr_in_record);
 
 	total_traces++;
@@ -1963,22 +5206,20 @@ int get_segy_trace(SEGY_file *segy_file, int verbose) {
 
 	/* Decode the trace data in double.
 	 */
-	if (dump || plot_data || scan || apply_correction || enable_X11) {
-		for (i = 0; i < n_samples; i++) {
-			segy_file->trace_data_double[i] = get_val(segy_file,
-					segy_file->trace_data, i);
-			if (trace_min_val > segy_file->trace_data_double[i])
-				trace_min_val = segy_file->trace_data_double[i];
-			if (trace_max_val < segy_file->trace_data_double[i])
-				trace_max_val = segy_file->trace_data_double[i];
+	if (decode_trace_samples()) {
+		segy_file->decode_samples(segy_file->trace_data,
+				segy_file->trace_data_double, n_samples);
+		if (scan || qc) {
+			sample_stats(segy_file->trace_data_double, n_samples,
+					qc_clip_level(segy_file), &trace_stats);
+			trace_min_val = my_min(trace_min_val, trace_stats.min);
+			trace_max_val = my_max(trace_max_val, trace_stats.max);
 		}
 	}
 
 	double x, y;
 	int uom;
-	if (dump_xy
-			&& keep_trace(segy_file, rec_start, rec_end, trace_start,
-					trace_end, trace_offset)) {
+	if (dump_xy && segy_file->keep) {
 		printf("%d %d %d ",
 				GET_SEGYTRACEH_Original_field_record_number(
 						&segy_file->trace_header),
@@ -2020,10 +5261,8 @@ int get_segy_trace(SEGY_file *segy_file, int verbose) {
 	}
 
 	if (dump_fields) {
-		int field_segy_offset, jjj;
-		char field_segy_type;
-		int m_field_nr = 1;
-		char m_field[1000], m_fields[1000], value[1000];
+		int k;
+		char value[1000];
 
 		printf("Rec/Seq/Num = %d/%d/%d : fields = ",
 				GET_SEGYTRACEH_Original_field_record_number(
@@ -2032,53 +5271,650 @@ int get_segy_trace(SEGY_file *segy_file, int verbose) {
 						&segy_file->trace_header),
 				GET_SEGYTRACEH_Trace_number_within_field_record(
 						&segy_file->trace_header));
-		while (get_field(fields_to_dump, m_field_nr, m_fields, ',')) {
-			if (m_field_nr > 1)
+		for (k = 0; k < num_trace_fields_dump; k++) {
+			FIELD_SPEC *f = trace_fields_dump + k;
+			if (k > 0)
 				printf("; ");
-			get_field(m_fields, 1, m_field, ':');
-			jjj = get_parameter_index_by_offset(trace_header_types,
-					atoi(m_field));
-			field_segy_offset = atoi(m_field);
-			get_field(m_fields, 2, m_field, ':');
-			field_segy_type = m_field[0];
 			if (use_names)
-				printf("%s,%s", trace_header_names[jjj],
+				printf("%s,%s", trace_header_names[f->name_index],
 						get_str_val(segy_file->trace_header.HEADER, value,
-								field_segy_offset, field_segy_type));
+								f->offset, f->type));
 			else
-				printf("%d,%c,%s", field_segy_offset, field_segy_type,
+				printf("%d,%c,%s", f->offset, f->type,
 						get_str_val(segy_file->trace_header.HEADER, value,
-								field_segy_offset, field_segy_type));
-			m_field_nr++;
+								f->offset, f->type));
 		}
 
 		printf("\n");
 	}
 
-	processed_traces++;
-	return 0;
+	processed_traces++;
+	return 0;
+}
+
+/* TRACE DUMP.
+ * -dump writes the kept traces as text, by default, or with -dump_format
+ * as raw little endian float32 samples (F32), a NumPy .npy array of
+ * traces by samples (NPY), or records framed by little endian int32
+ * record, sequence, trace number and number of samples followed by the
+ * float32 samples (FRAMED).
+ */
+#define NPY_HEADER_SIZE 128
+
+char dump_format = 'T';
+FILE *dump_fp;
+long dump_traces;
+int dump_ns;
+char *dump_buf;
+size_t dump_buf_size;
+
+char *dump_buffer(size_t size) {
+	if (size > dump_buf_size) {
+		dump_buf_size = size;
+		dump_buf = (char *) realloc(dump_buf, dump_buf_size);
+		if (dump_buf == NULL)
+			prerror_and_exit("Error: Cannot allocate memory for the dump.\n");
+	}
+	return dump_buf;
+}
+
+char *format_digits(uint64_t m, char *out) {
+	char tmp[24];
+	int l = 0;
+	do {
+		tmp[l++] = '0' + m % 10;
+		m /= 10;
+	} while (m);
+	while (l)
+		*out++ = tmp[--l];
+	return out;
+}
+
+/* Write the shortest text that reads back as the same float, or as the
+ * same double when the value is not a float, like integers above 2^24.
+ * RETURN: THE END OF THE TEXT.
+ */
+char *format_shortest(double v, char *out) {
+	static double p10[61];
+	char digits[24];
+	uint64_t m = 0;
+	int e, p, k, l;
+
+	if (p10[0] == 0)
+		for (k = 0, p10[0] = 1; k < 60; k++)
+			p10[k + 1] = p10[k] * 10;
+	if (isnan(v))
+		return (char *) memcpy(out, "nan", 3) + 3;
+	if (signbit(v)) {
+		*out++ = '-';
+		v = -v;
+	}
+	if (isinf(v))
+		return (char *) memcpy(out, "inf", 3) + 3;
+	if (v == floor(v) && v < 1e15)
+		return format_digits((uint64_t) v, out);
+	if ((double) (float) v != v) {
+		l = sprintf(out, "%.17g", v);
+		return out + l;
+	}
+
+	/* Find the fewest significant digits that read back as v.
+	 */
+	e = (int) floor(log10(v));
+	for (p = 1; p <= 9; p++) {
+		k = p - 1 - e;
+		if (k > 60 || k < -60)
+			break;
+		double scaled = k >= 0 ? v * p10[k] : v / p10[-k];
+		m = (uint64_t) llround(scaled);
+		double back = k >= 0 ? m / p10[k] : m * p10[-k];
+		if ((float) back == (float) v)
+			break;
+	}
+	if (p > 9 || k > 60 || k < -60) {
+		l = sprintf(out, "%.9g", v);
+		return out + l;
+	}
+	l = format_digits(m, digits) - digits;
+	e += l - p; /* Rounding may have added a digit. */
+	while (l > 1 && digits[l - 1] == '0')
+		l--;
+
+	if (e >= 16 || e < -5) {
+		*out++ = digits[0];
+		if (l > 1) {
+			*out++ = '.';
+			out = (char *) memcpy(out, digits + 1, l - 1) + l - 1;
+		}
+		return out + sprintf(out, "e%+03d", e);
+	}
+	if (e < 0) {
+		*out++ = '0';
+		*out++ = '.';
+		for (k = -1; k > e; k--)
+			*out++ = '0';
+		return (char *) memcpy(out, digits, l) + l;
+	}
+	for (k = 0; k <= e || k < l; k++) {
+		if (k == e + 1)
+			*out++ = '.';
+		*out++ = k < l ? digits[k] : '0';
+	}
+	return out;
+}
+
+void write_dump(const void *buf, size_t size) {
+	if (fwrite(buf, 1, size, dump_fp) != size)
+		prerror_and_exit("Error writing the dump, aborting.\n");
+}
+
+/* Write the .npy header, with room to rewrite it with the final shape.
+ */
+void write_npy_header(long rows, int cols) {
+	char h[NPY_HEADER_SIZE + 1];
+	int l = sprintf(h, "\x93NUMPY....{'descr': '<f4', 'fortran_order': "
+			"False, 'shape': (%ld, %d), }", rows, cols);
+	memset(h + l, ' ', NPY_HEADER_SIZE - l);
+	h[6] = 1;
+	h[7] = 0;
+	h[8] = (NPY_HEADER_SIZE - 10) & 0xff;
+	h[9] = (NPY_HEADER_SIZE - 10) >> 8;
+	h[NPY_HEADER_SIZE - 1] = '\n';
+	write_dump(h, NPY_HEADER_SIZE);
+}
+
+int do_dump_trace() {
+	int i;
+	int rec = GET_SEGYTRACEH_Original_field_record_number(
+			&segy_file.trace_header);
+	int seq = GET_SEGYTRACEH_Trace_sequence_number_within_reel(
+			&segy_file.trace_header);
+	int num = GET_SEGYTRACEH_Trace_number_within_field_record(
+			&segy_file.trace_header);
+
+	if (!dump)
+		return 1;
+
+	if (dump_format == 'T') {
+		char *p = dump_buffer(100 + (size_t) n_samples * 32), *s = p;
+		p += sprintf(p, "Rec/Seq/Num = %d/%d/%d : %d\n", rec, seq, num,
+				n_samples);
+		for (i = 0; i < n_samples; i++) {
+			p = format_shortest(segy_file.trace_data_double[i], p);
+			*p++ = ',';
+		}
+		*p++ = '\n';
+		write_dump(s, p - s);
+		dump_traces++;
+		return 0;
+	}
+
+	if (dump_format == 'N') {
+		if (dump_traces == 0) {
+			dump_ns = n_samples;
+			write_npy_header(0, dump_ns);
+		} else if (n_samples != dump_ns)
+			prerror_and_exit(
+					"Error: NPY dump needs traces of the same length, trace %d/%d/%d has %d samples instead of %d.\n",
+					rec, seq, num, n_samples, dump_ns);
+	}
+	if (dump_format == 'K') {
+		int frame[4] = { rec, seq, num, n_samples };
+		if (!is_little_endian())
+			swap_bytes((unsigned char *) frame, 4, 4);
+		write_dump(frame, sizeof(frame));
+	}
+	float *f = (float *) dump_buffer((size_t) n_samples * sizeof(float));
+	for (i = 0; i < n_samples; i++)
+		f[i] = segy_file.trace_data_double[i];
+	if (!is_little_endian())
+		swap_bytes((unsigned char *) f, n_samples, 4);
+	write_dump(f, (size_t) n_samples * sizeof(float));
+	dump_traces++;
+	return 0;
+}
+
+void finish_dump() {
+	if (!dump)
+		return;
+	if (dump_format == 'N') {
+		if (dump_traces == 0)
+			write_npy_header(0, 0);
+		else if (fseek(dump_fp, 0, SEEK_SET) != 0)
+			prerror_and_exit("Error: cannot rewind the NPY dump, aborting.\n");
+		else
+			write_npy_header(dump_traces, dump_ns);
+	}
+	if (dump_fp != stdout)
+		fclose(dump_fp);
+	else
+		fflush(dump_fp);
+}
+
+/* COLUMNAR HEADER EXPORT.
+ * -export_trace_fields writes each selected field of the kept traces as
+ * a little endian array, int16, int32 or float32 by its type, in its own
+ * file of the given directory, with a manifest.json describing them.
+ * Trace samples are never decoded, with a memory mapped input only the
+ * headers are read.
+ */
+#define EXPORT_BATCH 65536
+
+typedef struct {
+	FIELD_SPEC field;
+	char *name;
+	FILE *fp;
+	unsigned char *buf;
+	int len;
+} EXPORT_COLUMN;
+
+bool export_fields;
+char *export_dir;
+EXPORT_COLUMN *export_columns;
+int num_export_columns;
+long export_traces;
+
+void flush_export_column(EXPORT_COLUMN *c) {
+	if (c->len > 0 && fwrite(c->buf, c->len, 1, c->fp) != 1)
+		prerror_and_exit("Error writing '%s' column, aborting.\n", c->name);
+	c->len = 0;
+}
+
+/* Parse dir,field,... and create the column files.
+ */
+void setup_export(char *str) {
+	char m_field[1000], path[4096];
+	int m_field_nr = 2, p;
+
+	export_dir = malloc(strlen(str) + 1);
+	get_field(str, 1, export_dir, ',');
+	if (mkdir(export_dir, 0777) != 0 && errno != EEXIST)
+		prerror_and_exit("Cannot create '%s' directory, aborting.\n",
+				export_dir);
+
+	while (get_field(str, m_field_nr++, m_field, ',')) {
+		export_columns = (EXPORT_COLUMN *) realloc(export_columns,
+				(num_export_columns + 1) * sizeof(EXPORT_COLUMN));
+		if (export_columns == NULL)
+			prerror_and_exit("Error: Cannot allocate memory for the fields.\n");
+		EXPORT_COLUMN *c = export_columns + num_export_columns++;
+		memset(c, 0, sizeof(EXPORT_COLUMN));
+		trim(m_field);
+		char *colon = strchr(m_field, ':');
+		if (isdigit((unsigned char) m_field[0]) && colon != NULL) {
+			c->field.offset = atoi(m_field);
+			c->field.type = colon[1];
+			*colon = '_';
+		} else {
+			p = get_parameter_index_by_name(trace_header_names, m_field);
+			c->field.offset = trace_header_types[p * 2];
+			c->field.type = trace_header_types[p * 2 + 1];
+		}
+		if (c->field.type != 'S' && c->field.type != 'I'
+				&& c->field.type != 'F')
+			prerror_and_exit("-export_trace_fields: unknown type of '%s'.\n",
+					m_field);
+		if (c->field.offset < 0
+				|| c->field.offset + (c->field.type == 'S' ? 2 : 4) > 240)
+			prerror_and_exit("FATAL ERROR: field offset %d out of the header.\n",
+					c->field.offset);
+		c->name = strdup(m_field);
+		snprintf(path, sizeof(path), "%s/%s.bin", export_dir, c->name);
+		if ((c->fp = fopen(path, "w")) == NULL)
+			prerror_and_exit("Cannot open '%s' file, aborting.\n", path);
+		c->buf = (unsigned char *) malloc(EXPORT_BATCH * 4);
+		if (c->buf == NULL)
+			prerror_and_exit("Error: Cannot allocate memory for the fields.\n");
+	}
+	if (num_export_columns == 0)
+		prerror_and_exit("-export_trace_fields needs at least one field.\n");
+}
+
+/* Append the fields of the current trace, header values are big endian
+ * and columns little endian.
+ */
+int do_export_trace() {
+	int k;
+
+	if (!export_fields)
+		return 1;
+	for (k = 0; k < num_export_columns; k++) {
+		EXPORT_COLUMN *c = export_columns + k;
+		unsigned char *h = segy_file.trace_header.HEADER + c->field.offset;
+		int size = c->field.type == 'S' ? 2 : 4;
+		unsigned char *o = c->buf + c->len;
+		if (size == 2) {
+			o[0] = h[1];
+			o[1] = h[0];
+		} else {
+			o[0] = h[3];
+			o[1] = h[2];
+			o[2] = h[1];
+			o[3] = h[0];
+		}
+		c->len += size;
+		if (c->len == EXPORT_BATCH * size)
+			flush_export_column(c);
+	}
+	export_traces++;
+	return 0;
+}
+
+void finish_export() {
+	char path[4096];
+	int k;
+
+	if (!export_fields)
+		return;
+	snprintf(path, sizeof(path), "%s/manifest.json", export_dir);
+	FILE *fp = fopen(path, "w");
+	if (fp == NULL)
+		prerror_and_exit("Cannot open '%s' file, aborting.\n", path);
+	fprintf(fp, "{\n  \"traces\": %ld,\n  \"fields\": [\n", export_traces);
+	for (k = 0; k < num_export_columns; k++) {
+		EXPORT_COLUMN *c = export_columns + k;
+		flush_export_column(c);
+		if (fclose(c->fp) != 0)
+			prerror_and_exit("Error writing '%s' column, aborting.\n", c->name);
+		fprintf(fp,
+				"    {\"name\": \"%s\", \"offset\": %d, \"dtype\": \"%s\", "
+				"\"file\": \"%s.bin\"}%s\n", c->name, c->field.offset,
+				c->field.type == 'S' ? "<i2" : c->field.type == 'I' ? "<i4" : "<f4",
+				c->name, k < num_export_columns - 1 ? "," : "");
+	}
+	fprintf(fp, "  ]\n}\n");
+	if (fclose(fp) != 0)
+		prerror_and_exit("Error writing '%s' file, aborting.\n", path);
+}
+
+void print_sample_stats(FILE *fp, SAMPLE_STATS *s) {
+	long finite = s->n - s->non_finite;
+	fprintf(fp, "%ld %g %g %g %g %ld %ld %ld\n", s->n,
+			finite ? s->min : 0, finite ? s->max : 0,
+			finite ? s->sum / finite : 0,
+			finite ? sqrt(s->sum2 / finite) : 0, s->zeros, s->non_finite,
+			s->clipped);
+}
+
+void flush_qc_record() {
+	if (qc_record_traces > 0) {
+		fprintf(qc_fp, "R %ld %ld ", qc_record_nr, qc_record_traces);
+		print_sample_stats(qc_fp, &qc_record_stats);
+	}
+	clear_sample_stats(&qc_record_stats);
+	qc_record_traces = 0;
+}
+
+/* Write the QC line of the current trace, and the one of the previous
+ * record when this trace starts a new one.
+ */
+void do_qc_trace() {
+	if (!qc)
+		return;
+
+	long record_nr = GET_SEGYTRACEH_Original_field_record_number(
+			&segy_file.trace_header);
+	if (qc_total_traces == 0)
+		fprintf(qc_fp,
+				"# T record seq trace samples min max mean rms zeros nan_inf clipped\n"
+				"# R record traces samples min max mean rms zeros nan_inf clipped\n"
+				"# A traces samples min max mean rms zeros nan_inf clipped\n");
+	if (record_nr != qc_record_nr)
+		flush_qc_record();
+	qc_record_nr = record_nr;
+
+	fprintf(qc_fp, "T %ld %d %d ", record_nr,
+			GET_SEGYTRACEH_Trace_sequence_number_within_reel(
+					&segy_file.trace_header),
+			GET_SEGYTRACEH_Trace_number_within_field_record(
+					&segy_file.trace_header));
+	print_sample_stats(qc_fp, &trace_stats);
+	merge_sample_stats(&qc_record_stats, &trace_stats);
+	merge_sample_stats(&qc_total_stats, &trace_stats);
+	qc_record_traces++;
+	qc_total_traces++;
+}
+
+void finish_qc_report() {
+	if (!qc)
+		return;
+	flush_qc_record();
+	fprintf(qc_fp, "A %ld ", qc_total_traces);
+	print_sample_stats(qc_fp, &qc_total_stats);
+	if (qc_fp != stdout)
+		fclose(qc_fp);
+}
+
+/* IN PLACE EDITING.
+ * With -in_place the changed bytes of the SEGY header and of the trace
+ * headers are written back into the input file with pwrite, the trace
+ * data is never rewritten. With -journal the original bytes of every
+ * change are saved and synced before the change is made, as the 8 bytes
+ * JOURNAL_MAGIC followed by records of big endian int64 offset, int32
+ * length and the original bytes; -undo_journal writes them back.
+ */
+#define JOURNAL_MAGIC "SEGYJRN1"
+#define IN_PLACE_BATCH 4096
+
+typedef struct {
+	off_t pos;
+	int len;
+	unsigned char orig[240], bytes[240];
+} IN_PLACE_PATCH;
+
+bool in_place;
+int in_place_fd = -1;
+FILE *journal_fp;
+IN_PLACE_PATCH *in_place_patches;
+int num_in_place_patches;
+
+void pwrite_all(int fd, const void *buf, size_t len, off_t pos, char *fname) {
+	while (len > 0) {
+		ssize_t w = pwrite(fd, buf, len, pos);
+		if (w < 0) {
+			if (errno == EINTR)
+				continue;
+			prerror_and_exit("Error while writing '%s': %s\n", fname,
+					strerror(errno));
+		}
+		buf = (const unsigned char *) buf + w;
+		len -= w;
+		pos += w;
+	}
+}
+
+void pread_all(int fd, void *buf, size_t len, off_t pos, char *fname) {
+	while (len > 0) {
+		ssize_t r = pread(fd, buf, len, pos);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			prerror_and_exit("Error while reading '%s': %s\n", fname,
+					r ? strerror(errno) : "end of file");
+		buf = (unsigned char *) buf + r;
+		len -= r;
+		pos += r;
+	}
+}
+
+void journal_bytes(off_t pos, const unsigned char *orig, int len) {
+	unsigned char h[12];
+	set_int((int) ((int64_t) pos >> 32), h);
+	set_int((int) (pos & 0xffffffff), h + 4);
+	set_int(len, h + 8);
+	if (fwrite(h, 12, 1, journal_fp) != 1 || fwrite(orig, len, 1, journal_fp) != 1)
+		prerror_and_exit("Error writing the journal, aborting.\n");
+}
+
+void sync_journal() {
+	if (fflush(journal_fp) != 0 || fsync(fileno(journal_fp)) != 0)
+		prerror_and_exit("Error writing the journal, aborting.\n");
+}
+
+/* Journal and write the pending trace header changes.
+ */
+void flush_in_place_patches() {
+	int i;
+	if (num_in_place_patches == 0)
+		return;
+	if (journal_fp) {
+		for (i = 0; i < num_in_place_patches; i++)
+			journal_bytes(in_place_patches[i].pos, in_place_patches[i].orig,
+					in_place_patches[i].len);
+		sync_journal();
+	}
+	for (i = 0; i < num_in_place_patches; i++)
+		pwrite_all(in_place_fd, in_place_patches[i].bytes,
+				in_place_patches[i].len, in_place_patches[i].pos,
+				segy_file.fname);
+	num_in_place_patches = 0;
+}
+
+/* Find the span of bytes differing between orig and bytes.
+ * RETURN: ITS LENGTH, 0 WHEN THEY ARE EQUAL.
+ */
+int changed_span(const unsigned char *orig, const unsigned char *bytes,
+		int len, int *first) {
+	int last = len - 1;
+	*first = 0;
+	while (*first < len && orig[*first] == bytes[*first])
+		(*first)++;
+	if (*first == len)
+		return 0;
+	while (orig[last] == bytes[last])
+		last--;
+	return last - *first + 1;
+}
+
+void patch_header_in_place() {
+	unsigned char orig[sizeof(out_segy_file.header)];
+	int first, len;
+
+	if (replace_ebcdic)
+		memcpy(&out_segy_file.header, my_ebcdic, 3200);
+	if (pread(in_place_fd, orig, sizeof(orig), initial_seek) != sizeof(orig))
+		prerror_and_exit("Cannot read the SEGY HEADER.\n");
+	len = changed_span(orig, (unsigned char *) &out_segy_file.header,
+			sizeof(orig), &first);
+	if (len == 0)
+		return;
+	if (journal_fp) {
+		journal_bytes(initial_seek + first, orig + first, len);
+		sync_journal();
+	}
+	pwrite_all(in_place_fd, (unsigned char *) &out_segy_file.header + first,
+			len, initial_seek + first, segy_file.fname);
+}
+
+void patch_trace_in_place() {
+	unsigned char buf[240];
+	const unsigned char *orig;
+	int first, len;
+
+	if (segy_file.map != NULL)
+		orig = segy_file.map + segy_file.trace_pos;
+	else if (pread(in_place_fd, buf, 240, segy_file.trace_pos) == 240)
+		orig = buf;
+	else
+		prerror_and_exit("Cannot read back the trace header at byte %ld.\n",
+				(long) segy_file.trace_pos);
+	len = changed_span(orig, out_segy_file.trace_header.HEADER, 240, &first);
+	if (len == 0)
+		return;
+
+	if (in_place_patches == NULL) {
+		in_place_patches = (IN_PLACE_PATCH *) malloc(
+				IN_PLACE_BATCH * sizeof(IN_PLACE_PATCH));
+		if (in_place_patches == NULL)
+			prerror_and_exit("Error: Cannot allocate memory for the changes.\n");
+	}
+	IN_PLACE_PATCH *p = in_place_patches + num_in_place_patches++;
+	p->pos = segy_file.trace_pos + first;
+	p->len = len;
+	memcpy(p->orig, orig + first, len);
+	memcpy(p->bytes, out_segy_file.trace_header.HEADER + first, len);
+	if (num_in_place_patches == IN_PLACE_BATCH)
+		flush_in_place_patches();
 }
 
-int do_dump_trace() {
-	int i;
-	if (!dump)
-		return 1;
+void finish_in_place() {
+	flush_in_place_patches();
+	if (fsync(in_place_fd) != 0 || close(in_place_fd) != 0)
+		prerror_and_exit("Error while writing '%s': %s\n", segy_file.fname,
+				strerror(errno));
+	if (journal_fp && fclose(journal_fp) != 0)
+		prerror_and_exit("Error writing the journal, aborting.\n");
+}
 
-	printf("Rec/Seq/Num = %d/%d/%d : ",
-			GET_SEGYTRACEH_Original_field_record_number(
-					&segy_file.trace_header),
-			GET_SEGYTRACEH_Trace_sequence_number_within_reel(
-					&segy_file.trace_header),
-			GET_SEGYTRACEH_Trace_number_within_field_record(
-					&segy_file.trace_header));
+/* Open the input file for writing too, after checking that nothing asks
+ * for a different trace data.
+ */
+void setup_in_place() {
+	if (segy_file.fp == NULL || segy_file.fp == stdin)
+		prerror_and_exit("Error: -in_place needs an input file given with -f.\n");
+	if (output_segy)
+		prerror_and_exit("Error: -in_place cannot be used with -o.\n");
+	if (convert_to != ' ' || vertical_stack > 1 || apply_correction
+			|| skip_nsamples != -1 || only_nsamples != -1 || flip_endianess
+			|| no_header)
+		prerror_and_exit(
+				"Error: -in_place can only change headers, it cannot be used with -convert,\n"
+				"-vertical_stack, -do_op, -skip_n_samples, -only_n_samples, -flip_endianess\n"
+				"or -no_header.\n");
+	in_place_fd = open(segy_file.fname, O_RDWR);
+	if (in_place_fd < 0)
+		prerror_and_exit("Cannot open '%s' for writing: %s\n", segy_file.fname,
+				strerror(errno));
+	output_segy = 1;
+}
 
-	printf("%d\n", n_samples);
-	for (i = 0; i < n_samples; i++) {
-		printf("%lf,", segy_file.trace_data_double[i]);
+/* Write back the original bytes saved by -journal into the file, last
+ * change first.
+ */
+void undo_journal(char *jname, char *fname) {
+	struct stat st;
+	size_t pos, *records;
+	long num = 0, i;
+
+	FILE *fp = fopen(jname, "r");
+	if (fp == NULL || fstat(fileno(fp), &st) != 0)
+		prerror_and_exit("Cannot open '%s' file, aborting.\n", jname);
+	unsigned char *data = (unsigned char *) malloc(st.st_size + 1);
+	records = (size_t *) malloc((st.st_size / 13 + 1) * sizeof(size_t));
+	if (data == NULL || records == NULL)
+		prerror_and_exit("Error: Cannot allocate memory for the journal.\n");
+	if (fread(data, 1, st.st_size, fp) != (size_t) st.st_size
+			|| st.st_size < 8 || memcmp(data, JOURNAL_MAGIC, 8) != 0)
+		prerror_and_exit("'%s' is not a journal, aborting.\n", jname);
+	fclose(fp);
+
+	/* Every record holds at least 13 bytes.
+	 */
+	for (pos = 8; pos < (size_t) st.st_size; num++) {
+		if (pos + 12 > (size_t) st.st_size
+				|| pos + 12 + get_int(data + pos + 8) > (size_t) st.st_size
+				|| get_int(data + pos + 8) <= 0)
+			prerror_and_exit("'%s' journal is truncated, aborting.\n", jname);
+		records[num] = pos;
+		pos += 12 + get_int(data + pos + 8);
 	}
-	printf("\n");
 
-	return 0;
+	int fd = open(fname, O_RDWR);
+	if (fd < 0)
+		prerror_and_exit("Cannot open '%s' for writing: %s\n", fname,
+				strerror(errno));
+	for (i = num - 1; i >= 0; i--) {
+		unsigned char *r = data + records[i];
+		off_t offset = ((uint64_t) (unsigned int) get_int(r) << 32)
+				| (unsigned int) get_int(r + 4);
+		pwrite_all(fd, r + 12, get_int(r + 8), offset, fname);
+	}
+	if (fsync(fd) != 0 || close(fd) != 0)
+		prerror_and_exit("Error while writing '%s': %s\n", fname,
+				strerror(errno));
+	fprintf(stderr, "%ld changes undone.\n", num);
+	free(data);
+	free(records);
 }
 
 /* initialize all variables.
@@ -2094,8 +5930,14 @@ void setup() {
 	trace_end = rec_end = output_segy = verbose = n_traces = n_samples =
 			reccnt = 0;
 	dump = false;
+	dump_format = 'T';
+	dump_fp = stdout;
+	dump_traces = 0;
 	print_rec_seq_num = dump_header_fields = change_header_fields = add_xy =
 	false;
+	add_nav = nav_by_time = update_fields = export_fields = false;
+	in_place = false;
+	journal_fp = NULL;
 	dump_xy = shot_renumber = trace_renumber = false;
 	processed_traces = use_names = 0;
 	enable_X11 = no_header = plot_data = false;
@@ -2104,19 +5946,53 @@ void setup() {
 	trace_min_val = 1e100;
 	trace_max_val = -1e100;
 	scan = 0;
+	qc = false;
+	qc_fp = NULL;
+	qc_clip = 0;
+	clear_sample_stats(&qc_record_stats);
+	clear_sample_stats(&qc_total_stats);
+	qc_record_nr = -1;
+	qc_record_traces = qc_total_traces = 0;
 	correction_op = '+';
 	correction_val = 0.0;
 
 	convert_to = ' ';
 	count = 1;
 
-	fields_to_dump = fields_to_change_fname = add_coordinates_fname = NULL;
+	fields_to_change_fname = add_coordinates_fname = save_coordinates_fname =
+			NULL;
+	trace_fields_dump = header_fields_dump = header_fields_change = NULL;
+	num_trace_fields_dump = num_header_fields_dump =
+			num_header_fields_change = 0;
 	only_traces_with = dump_fields = change_fields = false;
 
 	out_segy_file.trace_data = NULL;
 	out_segy_file.trace_data_double = NULL;
 	segy_file.trace_data = NULL;
 	segy_file.trace_data_double = NULL;
+	segy_file.trace_buffer = out_segy_file.trace_buffer = NULL;
+	segy_file.map = out_segy_file.map = NULL;
+	build_index = header_only = build_key_index = false;
+	num_index_keys = num_key_ranges = 0;
+	key_index = NULL;
+	key_index_len = key_index_size = 0;
+	build_xy_index = xy_query = xy_polygon_len = 0;
+	xy_index = NULL;
+	xy_index_len = xy_index_size = 0;
+	xy_polygon = NULL;
+	trace_index = NULL;
+	trace_index_len = trace_index_size = 0;
+	visit_offsets = NULL;
+	num_visits = next_visit = 0;
+	out_segy_file.out_buffer = NULL;
+	out_segy_file.out_buffer_len = out_segy_file.out_buffer_size = 0;
+	out_buffer_mb = 64;
+	prefetch_slots = 0;
+	prefetch_active = false;
+	num_threads = 1;
+	worker_traces = NULL;
+	worker_traces_len = worker_traces_size = 0;
+	use_mmap = true;
 	initial_record = 1;
 	initial_trace_seq = 1;
 	actual_row = 1;
@@ -2131,6 +6007,16 @@ void read_args(int argc, char **argv) {
 		remove_parms(&argc, argv, _n, 1),
 		use_names = true;
 
+	if ((_n = take_parm(argc, argv, "-no_mmap", 0)))
+		remove_parms(&argc, argv, _n, 1),
+		use_mmap = false;
+
+	if ((_n = take_parm(argc, argv, "-prefetch", 1))) {
+		prefetch_slots = atoi(argv[_n + 1]);
+		use_mmap = false;
+		remove_parms(&argc, argv, _n, 2);
+	}
+
 	if ((_n = take_parm(argc, argv, "-segy_info", 0))) {
 		print_segy_info();
 		exit(0);
@@ -2160,6 +6046,21 @@ void read_args(int argc, char **argv) {
 		remove_parms(&argc, argv, _n, 1),
 		scan = true;
 
+	if ((_n = take_parm(argc, argv, "-qc", 1))) {
+		char *fname = malloc(strlen(argv[_n + 1]) + 1);
+		char clip[100];
+		qc = true;
+		get_field(argv[_n + 1], 1, fname, ',');
+		if (get_field(argv[_n + 1], 2, clip, ','))
+			qc_clip = atof(clip);
+		if (strcmp(fname, "-") == 0)
+			qc_fp = stdout;
+		else if ((qc_fp = fopen(fname, "w")) == NULL)
+			prerror_and_exit("Cannot open '%s' file, aborting.\n", fname);
+		free(fname);
+		remove_parms(&argc, argv, _n, 2);
+	}
+
 	flip_endianess = false;
 	if ((_n = take_parm(argc, argv, "-flip_endianess", 0))) {
 		remove_parms(&argc, argv, _n, 1),
@@ -2230,9 +6131,12 @@ void read_args(int argc, char **argv) {
 		if (use_names) {
 			from_names_to_offsets(segy_header_names, argv[_n + 1],
 					my_header_fields_offsets);
-			header_fields_to_dump = my_header_fields_offsets;
+			num_header_fields_dump = compile_field_specs(
+					my_header_fields_offsets, segy_header_types, 3600,
+					&header_fields_dump);
 		} else
-			header_fields_to_dump = argv[_n + 1];
+			num_header_fields_dump = compile_field_specs(argv[_n + 1],
+					segy_header_types, 3600, &header_fields_dump);
 		remove_parms(&argc, argv, _n, 2);
 	}
 
@@ -2246,20 +6150,18 @@ void read_args(int argc, char **argv) {
 		if (use_names) {
 			from_names_to_offsets(segy_header_names, argv[_n + 1],
 					my_header_fields_offsets);
-			header_fields_to_change = my_header_fields_offsets;
+			num_header_fields_change = compile_field_specs(
+					my_header_fields_offsets, segy_header_types, 3600,
+					&header_fields_change);
 		} else
-			header_fields_to_change = argv[_n + 1];
+			num_header_fields_change = compile_field_specs(argv[_n + 1],
+					segy_header_types, 3600, &header_fields_change);
 		remove_parms(&argc, argv, _n, 2);
 	}
 
 	if ((_n = take_parm(argc, argv, "-only_traces_with", 1))) {
 		only_traces_with = true;
-		if (use_names) {
-			from_names_to_offsets(trace_header_names, argv[_n + 1],
-					my_valid_traces_fields_offsets);
-			traces_fields_valid_values = my_valid_traces_fields_offsets;
-		} else
-			traces_fields_valid_values = argv[_n + 1];
+		compile_trace_predicate(argv[_n + 1]);
 		remove_parms(&argc, argv, _n, 2);
 	}
 
@@ -2268,9 +6170,18 @@ void read_args(int argc, char **argv) {
 		if (use_names) {
 			from_names_to_offsets(trace_header_names, argv[_n + 1],
 					my_traces_fields_offsets);
-			fields_to_dump = my_traces_fields_offsets;
+			num_trace_fields_dump = compile_field_specs(
+					my_traces_fields_offsets, trace_header_types, 240,
+					&trace_fields_dump);
 		} else
-			fields_to_dump = argv[_n + 1];
+			num_trace_fields_dump = compile_field_specs(argv[_n + 1],
+					trace_header_types, 240, &trace_fields_dump);
+		remove_parms(&argc, argv, _n, 2);
+	}
+
+	if ((_n = take_parm(argc, argv, "-export_trace_fields", 1))) {
+		export_fields = true;
+		setup_export(argv[_n + 1]);
 		remove_parms(&argc, argv, _n, 2);
 	}
 
@@ -2284,6 +6195,12 @@ void read_args(int argc, char **argv) {
 		remove_parms(&argc, argv, _n, 2);
 	}
 
+	if ((_n = take_parm(argc, argv, "-update_trace_fields", 1))) {
+		update_fields = true;
+		read_update_table(argv[_n + 1]);
+		remove_parms(&argc, argv, _n, 2);
+	}
+
 	if ((_n = take_parm(argc, argv, "-EBCDIC", 1))) {
 		FILE *f;
 		f = fopen(argv[_n + 1], "r");
@@ -2315,6 +6232,11 @@ void read_args(int argc, char **argv) {
 		remove_parms(&argc, argv, _n, 2);
 	}
 
+	if ((_n = take_parm(argc, argv, "-save_xy", 1))) {
+		save_coordinates_fname = strdup(argv[_n + 1]);
+		remove_parms(&argc, argv, _n, 2);
+	}
+
 	if ((_n = take_parm(argc, argv, "-add_xy", 1))) {
 		add_xy = true;
 		add_coordinates_fname = malloc(strlen(argv[_n + 1]) + 1);
@@ -2333,6 +6255,34 @@ void read_args(int argc, char **argv) {
 		remove_parms(&argc, argv, _n, 2);
 	}
 
+	if ((_n = take_parm(argc, argv, "-add_nav", 1))) {
+		if (add_xy)
+			prerror_and_exit("-add_nav and -add_xy cannot be used together.\n");
+		add_nav = true;
+		char *fname = malloc(strlen(argv[_n + 1]) + 1);
+		get_field(argv[_n + 1], 1, fname, ',');
+		char *tmp = malloc(strlen(argv[_n + 1]) + 1);
+		get_field(argv[_n + 1], 2, tmp, ',');
+		source_1_or_receiver_2 = 0;
+		if (strcmp(tmp, "SOURCE") == 0)
+			source_1_or_receiver_2 = 1;
+		if (strcmp(tmp, "RECEIVER") == 0)
+			source_1_or_receiver_2 = 2;
+		if (source_1_or_receiver_2 != 1 && source_1_or_receiver_2 != 2)
+			prerror_and_exit(
+					"either SOURCE or RECEIVER must be given with the switch -add_nav.\n");
+		get_field(argv[_n + 1], 3, tmp, ',');
+		if (strcmp(tmp, "TIME") == 0)
+			nav_by_time = true;
+		else if (strcmp(tmp, "RECORD") != 0)
+			prerror_and_exit(
+					"either TIME or RECORD must be given with the switch -add_nav.\n");
+		free(tmp);
+		read_nav(fname);
+		free(fname);
+		remove_parms(&argc, argv, _n, 2);
+	}
+
 	if ((_n = take_parm(argc, argv, "-irc", 1))) {
 		shot_renumber = true;
 		initial_record = atol(argv[_n + 1]);
@@ -2402,6 +6352,31 @@ void read_args(int argc, char **argv) {
 		remove_parms(&argc, argv, _n, 1);
 	}
 
+	if ((_n = take_parm(argc, argv, "-dump_format", 1))) {
+		char *fname = malloc(strlen(argv[_n + 1]) + 1);
+		dump = 1;
+		get_field(argv[_n + 1], 1, fname, ',');
+		if (strcmp(fname, "TEXT") == 0)
+			dump_format = 'T';
+		else if (strcmp(fname, "F32") == 0)
+			dump_format = 'F';
+		else if (strcmp(fname, "NPY") == 0)
+			dump_format = 'N';
+		else if (strcmp(fname, "FRAMED") == 0)
+			dump_format = 'K';
+		else
+			prerror_and_exit(
+					"either TEXT, F32, NPY or FRAMED must be given with the switch -dump_format.\n");
+		if (get_field(argv[_n + 1], 2, fname, ',') && strcmp(fname, "-") != 0
+				&& (dump_fp = fopen(fname, "w")) == NULL)
+			prerror_and_exit("Cannot open '%s' file, aborting.\n", fname);
+		if (dump_format == 'N' && fseek(dump_fp, 0, SEEK_CUR) != 0)
+			prerror_and_exit(
+					"Error: the NPY dump must go to a file, not to a pipe.\n");
+		free(fname);
+		remove_parms(&argc, argv, _n, 2);
+	}
+
 	if ((_n = take_parm(argc, argv, "-info", 0))) {
 		if ((_n = take_parm(argc, argv, "-f", 1)))
 			if (open_segy(&segy_file, argv[_n + 1],
@@ -2412,6 +6387,84 @@ void read_args(int argc, char **argv) {
 		exit(0);
 	}
 
+	if ((_n = take_parm(argc, argv, "-build_index", 0))) {
+		remove_parms(&argc, argv, _n, 1),
+		build_index = true;
+		if (skip_ntraces != 0 || only_ntraces != -1)
+			prerror_and_exit("Error: -build_index must read the whole file, it cannot be used with -skip_n_traces or -only_n_traces.\n");
+	}
+
+	if ((_n = take_parm(argc, argv, "-build_key_index", 1))) {
+		parse_index_keys(argv[_n + 1]);
+		remove_parms(&argc, argv, _n, 2);
+		build_key_index = true;
+		if (skip_ntraces != 0 || only_ntraces != -1)
+			prerror_and_exit("Error: -build_key_index must read the whole file, it cannot be used with -skip_n_traces or -only_n_traces.\n");
+	}
+
+	if ((_n = take_parm(argc, argv, "-build_xy_index", 1))) {
+		build_xy_index = parse_xy_kind(argv[_n + 1], "-build_xy_index");
+		remove_parms(&argc, argv, _n, 2);
+		if (skip_ntraces != 0 || only_ntraces != -1)
+			prerror_and_exit("Error: -build_xy_index must read the whole file, it cannot be used with -skip_n_traces or -only_n_traces.\n");
+	}
+
+	if ((_n = take_parm(argc, argv, "-key_range", 1))) {
+		parse_key_ranges(argv[_n + 1]);
+		remove_parms(&argc, argv, _n, 2);
+		if (build_index || build_key_index || build_xy_index
+				|| skip_ntraces != 0)
+			prerror_and_exit("Error: -key_range cannot be used with -build_index, -build_key_index,\n-build_xy_index or -skip_n_traces.\n");
+	}
+
+	if ((_n = take_parm(argc, argv, "-xy_box", 1))) {
+		parse_xy_query(argv[_n + 1], "-xy_box", true);
+		remove_parms(&argc, argv, _n, 2);
+	}
+
+	if ((_n = take_parm(argc, argv, "-xy_polygon", 1))) {
+		if (xy_query)
+			prerror_and_exit("Error: -xy_box and -xy_polygon are not allowed together.\n");
+		parse_xy_query(argv[_n + 1], "-xy_polygon", false);
+		remove_parms(&argc, argv, _n, 2);
+	}
+
+	if (xy_query && (build_index || build_key_index || build_xy_index
+			|| num_key_ranges > 0 || skip_ntraces != 0))
+		prerror_and_exit("Error: -xy_box and -xy_polygon cannot be used with -build_index,\n-build_key_index, -build_xy_index, -key_range or -skip_n_traces.\n");
+
+	if ((_n = take_parm(argc, argv, "-threads", 1))) {
+		num_threads = atoi(argv[_n + 1]);
+		if (num_threads < 1)
+			num_threads = 1;
+		remove_parms(&argc, argv, _n, 2);
+	}
+
+	if ((_n = take_parm(argc, argv, "-out_buffer", 1))) {
+		out_buffer_mb = atol(argv[_n + 1]);
+		remove_parms(&argc, argv, _n, 2);
+	}
+
+	if ((_n = take_parm(argc, argv, "-undo_journal", 1))) {
+		char *jname = argv[_n + 1];
+		if (!(_n = take_parm(argc, argv, "-f", 1)))
+			prerror_and_exit("Error: -undo_journal needs the file given with -f.\n");
+		undo_journal(jname, argv[_n + 1]);
+		exit(0);
+	}
+
+	if ((_n = take_parm(argc, argv, "-in_place", 0))) {
+		in_place = true;
+		remove_parms(&argc, argv, _n, 1);
+	}
+
+	if ((_n = take_parm(argc, argv, "-journal", 1))) {
+		if ((journal_fp = fopen(argv[_n + 1], "w")) == NULL)
+			prerror_and_exit("Cannot open '%s' file, aborting.\n", argv[_n + 1]);
+		fwrite(JOURNAL_MAGIC, 1, 8, journal_fp);
+		remove_parms(&argc, argv, _n, 2);
+	}
+
 	output_segy = 0;
 	if ((_n = take_parm(argc, argv, "-o", 1))) {
 		output_segy = 1;
@@ -2469,6 +6522,21 @@ void read_args(int argc, char **argv) {
 		}
 		remove_parms(&argc, argv, _n, 2);
 	}
+	if (in_place)
+		setup_in_place();
+	else if (journal_fp)
+		prerror_and_exit("Error: -journal needs -in_place.\n");
+	if (build_index && segy_file.fp == stdin)
+		prerror_and_exit("Error: -build_index cannot be used when reading from stdin.\n");
+	if ((build_key_index || num_key_ranges > 0) && segy_file.fp == stdin)
+		prerror_and_exit("Error: -build_key_index and -key_range cannot be used when reading from stdin.\n");
+	if ((build_xy_index || xy_query) && segy_file.fp == stdin)
+		prerror_and_exit("Error: -build_xy_index, -xy_box and -xy_polygon cannot be used when reading from stdin.\n");
+
+	/* Nothing looks at the samples, only the trace headers are read.
+	 */
+	header_only = (!output_segy || in_place) && !decode_trace_samples()
+			&& skip_nsamples == -1 && only_nsamples == -1;
 	if(argc > 1)
 	{
 		printf("Error, the following given args are unknown:\n");
@@ -2484,218 +6552,351 @@ void do_copy_header() {
 
 void do_write_header() {
 	if (output_segy && !no_header) {
-		write_segy_header(&out_segy_file);
-		fflush(out_segy_file.fp);
+		if (in_place)
+			patch_header_in_place();
+		else
+			write_segy_header(&out_segy_file);
 	}
 }
 
-void do_change_trace() {
-	if (output_segy) {
-		copy_segy_trace_header(&segy_file, &out_segy_file);
+/* Store the already scaled coordinates into the source or receiver
+ * fields of the trace header, the elevation only when it is not NaN.
+ */
+void set_trace_xy(unsigned char *header, double x, double y, double z,
+		int unit_of_measure_1_feet_or_meters_2_arcsec) {
+	set_short(unit_of_measure_1_feet_or_meters_2_arcsec, header + 88); // Unit coordinate system (1-meters, 2-seconds of arc)
+	set_short(coordinates_scaling_factor, header + 70);
+	switch (source_1_or_receiver_2) {
+	case 1:
+		set_int(round(x), header + 72);
+		set_int(round(y), header + 76);
+		break;
+	case 2:
+		set_int(round(x), header + 80);
+		set_int(round(y), header + 84);
+		break;
+	default:
+		prerror_and_exit("Coordinates data corrupted, unknown type\n");
+		break;
+	}
+	if (!isnan(z)) {
+		set_short(elevation_scaling_factor, header + 68);
+		set_int(round(z), header + (source_1_or_receiver_2 == 1 ? 44 : 40));
+	}
+}
 
-		if (vertical_stack > 1 && output_segy) {
-			set_short(
-					get_short((void*) &out_segy_file.trace_header.HEADER + 116)
-							* vertical_stack,
-					(void*) &out_segy_file.trace_header.HEADER + 116);
-			set_short(
-					get_short((void*) &out_segy_file.trace_header.HEADER + 114)
-							/ vertical_stack,
-					(void*) &out_segy_file.trace_header.HEADER + 114);
-		}
+/* Change the output trace header, this must be done in input order.
+ */
+void do_change_trace_header() {
+	copy_segy_trace_header(&segy_file, &out_segy_file);
 
-		if ((count - 1) % n_traces == 0) {
-			current_record++;
-			current_trace = initial_trace_seq;
-		}
+	if (vertical_stack > 1 && output_segy) {
+		set_short(
+				get_short((void*) &out_segy_file.trace_header.HEADER + 116)
+						* vertical_stack,
+				(void*) &out_segy_file.trace_header.HEADER + 116);
+		set_short(
+				get_short((void*) &out_segy_file.trace_header.HEADER + 114)
+						/ vertical_stack,
+				(void*) &out_segy_file.trace_header.HEADER + 114);
+	}
 
-		if (shot_renumber)
-			set_int(current_record, out_segy_file.trace_header.HEADER + 8);
+	if ((count - 1) % n_traces == 0) {
+		current_record++;
+		current_trace = initial_trace_seq;
+	}
 
-		if (trace_renumber)
-			set_int(current_trace, out_segy_file.trace_header.HEADER + 12);
+	if (shot_renumber)
+		set_int(current_record, out_segy_file.trace_header.HEADER + 8);
 
-		/* Add coordinates if needed.
-		 */
-		if (add_xy) {
-			long rec, seq, num;
-			rec = GET_SEGYTRACEH_Original_field_record_number(
-					&segy_file.trace_header);
-			seq = GET_SEGYTRACEH_Trace_sequence_number_within_reel(
-					&segy_file.trace_header);
-			num = GET_SEGYTRACEH_Trace_number_within_field_record(
+	if (trace_renumber)
+		set_int(current_trace, out_segy_file.trace_header.HEADER + 12);
+
+	/* Add coordinates if needed.
+	 */
+	if (add_xy) {
+		long rec, seq, num;
+		rec = GET_SEGYTRACEH_Original_field_record_number(
+				&segy_file.trace_header);
+		seq = GET_SEGYTRACEH_Trace_sequence_number_within_reel(
+				&segy_file.trace_header);
+		num = GET_SEGYTRACEH_Trace_number_within_field_record(
+				&segy_file.trace_header);
+
+		// find the correct entry
+		int jj = find_trace_key(&coords_index, rec, seq, num);
+		if (jj >= 0)
+			set_trace_xy(out_segy_file.trace_header.HEADER,
+					coords[jj].lon_or_x, coords[jj].lat_or_y,
+					coords[jj].elevation,
+					coords[jj].unit_of_measure_1_feet_or_meters_2_arcsec);
+	}
+
+	/* Or interpolate them from the navigation.
+	 */
+	if (add_nav) {
+		double key, x, y;
+		int uom;
+		unsigned char *h = segy_file.trace_header.HEADER;
+		if (nav_by_time)
+			key = nav_time(get_short(h + 156), get_short(h + 158),
+					get_short(h + 160), get_short(h + 162),
+					get_short(h + 164));
+		else
+			key = GET_SEGYTRACEH_Original_field_record_number(
 					&segy_file.trace_header);
+		if (interpolate_nav(key, &x, &y, &uom) == 0)
+			set_trace_xy(out_segy_file.trace_header.HEADER, x, y, NAN, uom);
+	}
 
-			// find the correct entry
-			int jj;
-			for (jj = 0; jj < num_coords; jj++) {
-				if (rec == coords[jj].original_field_record
-						&& seq == coords[jj].trace_seq_within_reel
-						&& num == coords[jj].trace_seq_within_field_record) {
-					set_short(
-							coords[jj].unit_of_measure_1_feet_or_meters_2_arcsec,
-							out_segy_file.trace_header.HEADER + 88); // Unit coordinate system (1-meters, 2-seconds of arc)
-					set_short(coordinates_scaling_factor,
-							out_segy_file.trace_header.HEADER + 70);
-					switch (source_1_or_receiver_2) {
-					case 1:
-						set_int(round(coords[jj].lon_or_x),
-								out_segy_file.trace_header.HEADER + 72);
-						set_int(round(coords[jj].lat_or_y),
-								out_segy_file.trace_header.HEADER + 76);
-						break;
-					case 2:
-						set_int(round(coords[jj].lon_or_x),
-								out_segy_file.trace_header.HEADER + 80);
-						set_int(round(coords[jj].lat_or_y),
-								out_segy_file.trace_header.HEADER + 84);
-						break;
-					default:
-						prerror_and_exit(
-								"Coordinates data corrupted, unknown type\n");
-						break;
+	/* Change fields if required.
+	 */
+	if (change_fields) {
+		int field_segy_offset, rec_nr_to_change, trace_nr_to_change,
+				trace_seq_to_change;
+		char field_segy_type;
+		char field_segy_value[1000];
+		int m_field_nr = 1;
+		char m_field[1000], m_fields[1000], line[100000];
+		char all_fields[10000];
+		char _b0[100000], _b1[100000];
+
+		if (file_of_fields) {
+			if (!feof(file_of_fields)) {
+				fgets(line, 99999, file_of_fields);
+				if (line[strlen(line) - 1] == '\n')
+					line[strlen(line) - 1] = 0;
+
+				/* Find rec/seq/trace number.
+				 */
+				if (get_field(line, 1, _b0, ':') == NULL)
+					prerror_and_exit(
+							"Error: file_of_fields format error.\n");
+				if (get_field(_b0, 2, _b1, '=') == NULL)
+					prerror_and_exit(
+							"Error: file_of_fields format error.\n");
+				if (get_field(_b1, 1, _b0, '/') == NULL)
+					prerror_and_exit(
+							"Error: file_of_fields format error.\n");
+				rec_nr_to_change = atol(_b0);
+				if (get_field(_b1, 2, _b0, '/') == NULL)
+					prerror_and_exit(
+							"Error: file_of_fields format error.\n");
+				trace_seq_to_change = atol(_b0);
+				if (get_field(_b1, 3, _b0, '/') == NULL)
+					prerror_and_exit(
+							"Error: file_of_fields format error.\n");
+				trace_nr_to_change = atol(_b0);
+				if (verbose)
+					printf("Changing Rec/Seq/Num = %d/%d/%d :",
+							rec_nr_to_change, trace_seq_to_change,
+							trace_nr_to_change);
+
+				if (rec_nr_to_change
+						!= GET_SEGYTRACEH_Original_field_record_number(
+								&out_segy_file.trace_header)
+						|| trace_nr_to_change
+								!= GET_SEGYTRACEH_Trace_number_within_field_record(
+										&out_segy_file.trace_header)
+						|| trace_seq_to_change
+								!= GET_SEGYTRACEH_Trace_sequence_number_within_reel(
+										&out_segy_file.trace_header))
+					prerror_and_exit(
+							"Error \"change_fields\" file got unsynchronized.");
+
+				/* Find the fields to change and their value/type.
+				 */
+				if (get_field(line, 2, _b0, ':') == NULL)
+					prerror_and_exit(
+							"Error: file_of_fields format error.\n");
+				if (get_field(_b0, 2, all_fields, '=') == NULL)
+					prerror_and_exit(
+							"Error: file_of_fields format error.\n");
+				m_field_nr = 1;
+				if (use_names) {
+					while (get_field(all_fields, m_field_nr, m_fields, ';')
+							!= NULL) {
+						get_field(m_fields, 1, m_field, ',');
+						trim(m_field);
+						field_segy_offset =
+								trace_header_types[get_parameter_index_by_name(
+										trace_header_names, m_field) * 2];
+						field_segy_type =
+								trace_header_types[get_parameter_index_by_name(
+										trace_header_names, m_field) * 2 + 1];
+						get_field(m_fields, 2, m_field, ',');
+						strcpy(field_segy_value, m_field);
+						if (verbose)
+							printf("%d,%c,%s; ", field_segy_offset,
+									field_segy_type, field_segy_value);
+						set_str_val(out_segy_file.trace_header.HEADER,
+								field_segy_value, field_segy_offset,
+								field_segy_type);
+						m_field_nr++;
+					}
+				} else {
+					while (get_field(all_fields, m_field_nr, m_fields, ';')
+							!= NULL) {
+						get_field(m_fields, 1, m_field, ',');
+						field_segy_offset = atoi(m_field);
+						get_field(m_fields, 2, m_field, ',');
+						field_segy_type = m_field[0];
+						get_field(m_fields, 3, m_field, ',');
+						strcpy(field_segy_value, m_field);
+						if (verbose)
+							printf("%d,%c,%s; ", field_segy_offset,
+									field_segy_type, field_segy_value);
+						set_str_val(out_segy_file.trace_header.HEADER,
+								field_segy_value, field_segy_offset,
+								field_segy_type);
+						m_field_nr++;
 					}
 				}
+				if (verbose)
+					printf("\n");
 			}
 		}
+	}
 
-		/* Change fields if required.
-		 */
-		if (change_fields) {
-			int field_segy_offset, rec_nr_to_change, trace_nr_to_change,
-					trace_seq_to_change;
-			char field_segy_type;
-			char field_segy_value[1000];
-			int m_field_nr = 1;
-			char m_field[1000], m_fields[1000], line[100000];
-			char all_fields[10000];
-			char _b0[100000], _b1[100000];
-
-			if (file_of_fields) {
-				if (!feof(file_of_fields)) {
-					fgets(line, 99999, file_of_fields);
-					if (line[strlen(line) - 1] == '\n')
-						line[strlen(line) - 1] = 0;
-
-					/* Find rec/seq/trace number.
-					 */
-					if (get_field(line, 1, _b0, ':') == NULL)
-						prerror_and_exit(
-								"Error: file_of_fields format error.\n");
-					if (get_field(_b0, 2, _b1, '=') == NULL)
-						prerror_and_exit(
-								"Error: file_of_fields format error.\n");
-					if (get_field(_b1, 1, _b0, '/') == NULL)
-						prerror_and_exit(
-								"Error: file_of_fields format error.\n");
-					rec_nr_to_change = atol(_b0);
-					if (get_field(_b1, 2, _b0, '/') == NULL)
-						prerror_and_exit(
-								"Error: file_of_fields format error.\n");
-					trace_seq_to_change = atol(_b0);
-					if (get_field(_b1, 3, _b0, '/') == NULL)
-						prerror_and_exit(
-								"Error: file_of_fields format error.\n");
-					trace_nr_to_change = atol(_b0);
-					if (verbose)
-						printf("Changing Rec/Seq/Num = %d/%d/%d :",
-								rec_nr_to_change, trace_seq_to_change,
-								trace_nr_to_change);
-
-					if (rec_nr_to_change
-							!= GET_SEGYTRACEH_Original_field_record_number(
-									&out_segy_file.trace_header)
-							|| trace_nr_to_change
-									!= GET_SEGYTRACEH_Trace_number_within_field_record(
-											&out_segy_file.trace_header)
-							|| trace_seq_to_change
-									!= GET_SEGYTRACEH_Trace_sequence_number_within_reel(
-											&out_segy_file.trace_header))
-						prerror_and_exit(
-								"Error \"change_fields\" file got unsynchronized.");
-
-					/* Find the fields to change and their value/type.
-					 */
-					if (get_field(line, 2, _b0, ':') == NULL)
-						prerror_and_exit(
-								"Error: file_of_fields format error.\n");
-					if (get_field(_b0, 2, all_fields, '=') == NULL)
-						prerror_and_exit(
-								"Error: file_of_fields format error.\n");
-					m_field_nr = 1;
-					if (use_names) {
-						while (get_field(all_fields, m_field_nr, m_fields, ';')
-								!= NULL) {
-							get_field(m_fields, 1, m_field, ',');
-							trim(m_field);
-							field_segy_offset =
-									trace_header_types[get_parameter_index_by_name(
-											trace_header_names, m_field) * 2];
-							field_segy_type =
-									trace_header_types[get_parameter_index_by_name(
-											trace_header_names, m_field) * 2 + 1];
-							get_field(m_fields, 2, m_field, ',');
-							strcpy(field_segy_value, m_field);
-							if (verbose)
-								printf("%d,%c,%s; ", field_segy_offset,
-										field_segy_type, field_segy_value);
-							set_str_val(out_segy_file.trace_header.HEADER,
-									field_segy_value, field_segy_offset,
-									field_segy_type);
-							m_field_nr++;
-						}
-					} else {
-						while (get_field(all_fields, m_field_nr, m_fields, ';')
-								!= NULL) {
-							get_field(m_fields, 1, m_field, ',');
-							field_segy_offset = atoi(m_field);
-							get_field(m_fields, 2, m_field, ',');
-							field_segy_type = m_field[0];
-							get_field(m_fields, 3, m_field, ',');
-							strcpy(field_segy_value, m_field);
-							if (verbose)
-								printf("%d,%c,%s; ", field_segy_offset,
-										field_segy_type, field_segy_value);
-							set_str_val(out_segy_file.trace_header.HEADER,
-									field_segy_value, field_segy_offset,
-									field_segy_type);
-							m_field_nr++;
-						}
-					}
-					if (verbose)
-						printf("\n");
-				}
-			}
+	/* Update fields from the keyed table.
+	 */
+	if (update_fields) {
+		int r = find_trace_key(&update_index,
+				GET_SEGYTRACEH_Original_field_record_number(
+						&segy_file.trace_header),
+				GET_SEGYTRACEH_Trace_sequence_number_within_reel(
+						&segy_file.trace_header),
+				GET_SEGYTRACEH_Trace_number_within_field_record(
+						&segy_file.trace_header));
+		if (r >= 0) {
+			double *v = update_values + (size_t) r * num_update_columns;
+			int c;
+			for (c = 0; c < num_update_columns; c++)
+				if (!isnan(v[c]))
+					set_field_value(out_segy_file.trace_header.HEADER,
+							update_columns + c, v[c]);
 		}
-		copy_segy_trace_data(&segy_file, &out_segy_file);
-		int out_n_samples = GET_SEGYTRACEH_Number_of_samples_in_this_trace(
-				&out_segy_file.trace_header);
-		if (apply_correction) {
-			for (i = 0; i < out_n_samples; i++) {
-				switch (correction_op) {
-				case '*':
-					SET_OUT_SAMPLE(GET_OUT_SAMPLE(i) * correction_val, i);
-					break;
-				case '/':
-					SET_OUT_SAMPLE(GET_OUT_SAMPLE(i) / correction_val, i);
-					break;
-				case '-':
-					SET_OUT_SAMPLE(GET_OUT_SAMPLE(i) - correction_val, i);
-					break;
-				case '+':
-					SET_OUT_SAMPLE(GET_OUT_SAMPLE(i) + correction_val, i);
-					break;
-				}
-			}
+	}
+}
+
+/* Make the output trace data from the input one, touching only the two
+ * given files so that it can run on several traces at once.
+ */
+void do_change_trace_data(SEGY_file *source, SEGY_file *dest) {
+	int i;
+	copy_segy_trace_data(source, dest);
+	int out_n_samples = GET_SEGYTRACEH_Number_of_samples_in_this_trace(
+			&dest->trace_header);
+	if (apply_correction) {
+		dest->trace_data_double = (double *) realloc(dest->trace_data_double,
+				out_n_samples * sizeof(double));
+		if (dest->trace_data_double == NULL)
+			prerror_and_exit("Error: Cannot allocate memory for TRACE DATA.\n");
+		double *v = dest->trace_data_double;
+		dest->decode_samples(dest->trace_data, v, out_n_samples);
+		switch (correction_op) {
+		case '*':
+			for (i = 0; i < out_n_samples; i++)
+				v[i] *= correction_val;
+			break;
+		case '/':
+			for (i = 0; i < out_n_samples; i++)
+				v[i] /= correction_val;
+			break;
+		case '-':
+			for (i = 0; i < out_n_samples; i++)
+				v[i] -= correction_val;
+			break;
+		case '+':
+			for (i = 0; i < out_n_samples; i++)
+				v[i] += correction_val;
+			break;
+		}
+		dest->encode_samples(v, dest->trace_data, out_n_samples);
+	}
+}
+
+/* PARALLEL TRACE PROCESSING.
+ * With -threads the traces to write are collected in batches, the data
+ * of a batch is made by a team of OpenMP threads and written back in the
+ * input order.
+ */
+void queue_worker_trace() {
+	if (worker_traces == NULL) {
+		worker_traces_size = 32 * num_threads;
+		worker_traces = (WORKER_TRACE *) calloc(worker_traces_size,
+				sizeof(WORKER_TRACE));
+		if (worker_traces == NULL)
+			prerror_and_exit("Error: Cannot allocate memory for the worker traces.\n");
+	}
+
+	WORKER_TRACE *w = worker_traces + worker_traces_len++;
+	memcpy(&w->in.header, &segy_file.header, sizeof(segy_file.header));
+	memcpy(&w->out.header, &out_segy_file.header, sizeof(out_segy_file.header));
+	w->in.decode_samples = segy_file.decode_samples;
+	w->out.decode_samples = out_segy_file.decode_samples;
+	w->out.encode_samples = out_segy_file.encode_samples;
+	w->out.transcode_samples = out_segy_file.transcode_samples;
+	memcpy(&w->in.trace_header, &segy_file.trace_header,
+			sizeof(segy_file.trace_header));
+	memcpy(&w->out.trace_header, &out_segy_file.trace_header,
+			sizeof(out_segy_file.trace_header));
+
+	/* Samples inside the memory map stay valid, the others are reused
+	 * by the next read.
+	 */
+	size_t len = trace_data_length(&segy_file);
+	if (segy_file.map != NULL && segy_file.trace_data >= segy_file.map
+			&& segy_file.trace_data < segy_file.map + segy_file.map_size)
+		w->in.trace_data = segy_file.trace_data;
+	else {
+		if (len > w->in_data_size) {
+			w->in_data = (unsigned char *) realloc(w->in_data, len);
+			if (w->in_data == NULL)
+				prerror_and_exit("Error: Cannot allocate memory for TRACE DATA.\n");
+			w->in_data_size = len;
 		}
+		memcpy(w->in_data, segy_file.trace_data, len);
+		w->in.trace_data = w->in_data;
+	}
+}
+
+void flush_worker_traces() {
+	int j;
+
+#pragma omp parallel for ordered schedule(dynamic, 1) num_threads(num_threads)
+	for (j = 0; j < worker_traces_len; j++) {
+		do_change_trace_data(&worker_traces[j].in, &worker_traces[j].out);
+#pragma omp ordered
+		write_segy_bytes(&out_segy_file, &worker_traces[j].out.trace_header,
+				sizeof(worker_traces[j].out.trace_header),
+				worker_traces[j].out.trace_data,
+				trace_data_length(&worker_traces[j].out));
+	}
+	worker_traces_len = 0;
+}
+
+void do_change_trace() {
+	if (output_segy) {
+		do_change_trace_header();
+		if (in_place)
+			return;
+		if (num_threads > 1)
+			queue_worker_trace();
+		else
+			do_change_trace_data(&segy_file, &out_segy_file);
 	}
 }
 
 void do_write_trace() {
 	if (output_segy) {
-		write_segy_trace_header(&out_segy_file);
-		write_segy_trace_data(&out_segy_file);
-		fflush(out_segy_file.fp);
+		if (in_place)
+			patch_trace_in_place();
+		else if (num_threads > 1) {
+			if (worker_traces_len == worker_traces_size)
+				flush_worker_traces();
+		} else
+			write_segy_trace(&out_segy_file);
 		count++;
 		current_trace++;
 	}
@@ -2703,13 +6904,323 @@ void do_write_trace() {
 
 int more_data() {
 	if (only_ntraces == -1)
-		return !feof(segy_file.fp);
+		return !segy_eof(&segy_file);
 	return only_ntraces >= processed_traces;
 }
 
+/* PARALLEL SCAN.
+ * When every trace has the number of samples given by the SEGY header,
+ * -scan with -threads splits the traces into chunks of fixed byte size,
+ * each chunk is read with pread and scanned by its own thread and the
+ * chunk counters are merged in file order, giving the serial totals.
+ */
+typedef struct {
+	long first, end; /* Trace interval of the chunk. */
+	long traces, record_changes, first_record, last_record, first_trace_nr;
+	double min_val, max_val;
+	bool mismatch; /* A trace has a different number of samples. */
+} SCAN_CHUNK;
+
+void scan_chunk(SEGY_file *segy_file, off_t start, int ns, SCAN_CHUNK *c) {
+	int sl = trace_sample_length(segy_file);
+	size_t trace_len = 240 + (size_t) ns * sl;
+	long batch = my_max(1, (8 * 1024 * 1024) / (long) trace_len);
+	unsigned char *buf = (unsigned char *) malloc(batch * trace_len);
+	double *v = (double *) malloc(ns * sizeof(double));
+	SEGY_file tr;
+	SAMPLE_STATS st;
+	long j, k, m, prev_record = 0;
+	int fd = fileno(segy_file->fp);
+
+	if (buf == NULL || v == NULL)
+		prerror_and_exit("Error: Cannot allocate memory for the scan.\n");
+	memcpy(&tr.header, &segy_file->header, sizeof(tr.header));
+	c->traces = c->record_changes = 0;
+	c->min_val = INFINITY;
+	c->max_val = -INFINITY;
+	c->mismatch = false;
+
+	for (j = c->first; j < c->end && !c->mismatch; j += m) {
+		m = my_min(batch, c->end - j);
+		pread_all(fd, buf, m * trace_len, start + (off_t) j * trace_len,
+				segy_file->fname);
+
+		for (k = 0; k < m; k++) {
+			unsigned char *p = buf + k * trace_len;
+			memcpy(&tr.trace_header, p, 240);
+			flip_trace_header_endianess(&tr);
+			if (GET_SEGYTRACEH_Number_of_samples_in_this_trace(
+					&tr.trace_header) != ns) {
+				c->mismatch = true;
+				break;
+			}
+			long record = GET_SEGYTRACEH_Original_field_record_number(
+					&tr.trace_header);
+			if (c->traces == 0) {
+				c->first_record = record;
+				c->first_trace_nr =
+						GET_SEGYTRACEH_Trace_number_within_field_record(
+								&tr.trace_header);
+			} else if (record != prev_record)
+				c->record_changes++;
+			prev_record = record;
+			c->traces++;
+
+			if (flip_endianess)
+				swap_bytes(p + 240, ns, sl);
+			segy_file->decode_samples(p + 240, v, ns);
+			sample_stats(v, ns, 0, &st);
+			c->min_val = my_min(c->min_val, st.min);
+			c->max_val = my_max(c->max_val, st.max);
+		}
+	}
+	c->last_record = prev_record;
+	free(buf);
+	free(v);
+}
+
+/* RETURN: TRUE WHEN THE SCAN HAS BEEN DONE HERE, FALSE WHEN IT MUST BE
+ * DONE BY THE MAIN LOOP.
+ */
+bool parallel_scan(SEGY_file *segy_file) {
+	struct stat st;
+	int ns, j, num_chunks;
+
+	if (!scan || num_threads < 2 || segy_file->fp == stdin || dump
+			|| dump_fields || dump_xy || print_rec_seq_num || output_segy
+			|| export_fields
+			|| plot_data || enable_X11 || qc || build_index || build_key_index
+			|| build_xy_index || verbose >= 2
+			|| skip_nsamples != -1 || only_nsamples != -1
+			|| only_ntraces != -1 || visit_offsets != NULL
+			|| prefetch_slots > 0)
+		return false;
+	if (!is_fixed_sample_format(segy_file))
+		return false;
+	ns = GET_SEGYH_Number_of_samples_per_datatrace_for_this_reel(
+			&segy_file->header);
+	off_t start = segy_tell(segy_file);
+	off_t trace_len = 240 + (off_t) ns * trace_sample_length(segy_file);
+	if (ns <= 0 || fstat(fileno(segy_file->fp), &st) != 0
+			|| !S_ISREG(st.st_mode) || st.st_size <= start
+			|| (st.st_size - start) % trace_len != 0)
+		return false;
+
+	long num_traces = (st.st_size - start) / trace_len;
+	num_chunks = my_min(num_traces, 8L * num_threads);
+	SCAN_CHUNK *chunks = (SCAN_CHUNK *) calloc(num_chunks, sizeof(SCAN_CHUNK));
+	if (chunks == NULL)
+		prerror_and_exit("Error: Cannot allocate memory for the scan.\n");
+	for (j = 0; j < num_chunks; j++) {
+		chunks[j].first = num_traces * j / num_chunks;
+		chunks[j].end = num_traces * (j + 1) / num_chunks;
+	}
+
+#pragma omp parallel for schedule(dynamic, 1) num_threads(num_threads)
+	for (j = 0; j < num_chunks; j++)
+		scan_chunk(segy_file, start, ns, chunks + j);
+
+	for (j = 0; j < num_chunks; j++)
+		if (chunks[j].mismatch) {
+			if (verbose >= 1)
+				fprintf(stderr, "The traces are not all %d samples long, scanning with a single thread.\n", ns);
+			free(chunks);
+			return false;
+		}
+
+	/* Merge in file order, as the serial scan would count.
+	 */
+	for (j = 0; j < num_chunks; j++) {
+		SCAN_CHUNK *c = chunks + j;
+		if (c->traces == 0)
+			continue;
+		if (total_traces == 0) {
+			min_num_samples = max_num_samples = n_samples = ns;
+			min_num_samples_rec_num = max_num_samples_rec_num =
+					c->first_record;
+			min_num_samples_trace_num = max_num_samples_trace_num =
+					c->first_trace_nr;
+		}
+		total_records += c->record_changes
+				+ (c->first_record != prev_record_nr);
+		prev_record_nr = c->last_record;
+		total_traces += c->traces;
+		processed_traces += c->traces;
+		trace_min_val = my_min(trace_min_val, c->min_val);
+		trace_max_val = my_max(trace_max_val, c->max_val);
+	}
+	free(chunks);
+	return true;
+}
+
+/* PARALLEL CONVERSION.
+ * When every trace has the number of samples given by the SEGY header and
+ * the traces are only converted (-convert, -flip_endianess, -do_op), -o
+ * with -threads splits the traces into chunks of fixed byte size. The
+ * output file is sized first, then each chunk is read with pread, changed
+ * by its own thread and written with pwrite at its own place in the
+ * output, so the threads never wait for each other.
+ */
+typedef struct {
+	long first, end; /* Trace interval of the chunk. */
+	long traces;
+	bool mismatch; /* A trace has a different number of samples. */
+} CONVERT_CHUNK;
+
+void convert_chunk(SEGY_file *segy_file, off_t start, int ns, off_t out_start,
+		CONVERT_CHUNK *c) {
+	int sl = trace_sample_length(segy_file);
+	size_t trace_len = 240 + (size_t) ns * sl;
+	size_t out_trace_len = 240 + (size_t) ns * trace_sample_length(&out_segy_file);
+	long batch = my_max(1, (8 * 1024 * 1024) / (long) trace_len);
+	unsigned char *buf = (unsigned char *) malloc(batch * trace_len);
+	unsigned char *out_buf = (unsigned char *) malloc(batch * out_trace_len);
+	SEGY_file in, out;
+	long j, k, m;
+	int fd = fileno(segy_file->fp);
+
+	if (buf == NULL || out_buf == NULL)
+		prerror_and_exit("Error: Cannot allocate memory for the conversion.\n");
+	memset(&in, 0, sizeof(in));
+	memset(&out, 0, sizeof(out));
+	memcpy(&in.header, &segy_file->header, sizeof(in.header));
+	memcpy(&out.header, &out_segy_file.header, sizeof(out.header));
+	in.decode_samples = segy_file->decode_samples;
+	out.decode_samples = out_segy_file.decode_samples;
+	out.encode_samples = out_segy_file.encode_samples;
+	out.transcode_samples = out_segy_file.transcode_samples;
+	c->traces = 0;
+	c->mismatch = false;
+
+	for (j = c->first; j < c->end && !c->mismatch; j += m) {
+		m = my_min(batch, c->end - j);
+		pread_all(fd, buf, m * trace_len, start + (off_t) j * trace_len,
+				segy_file->fname);
+
+		for (k = 0; k < m; k++) {
+			unsigned char *p = buf + k * trace_len;
+			memcpy(&in.trace_header, p, 240);
+			flip_trace_header_endianess(&in);
+			if (GET_SEGYTRACEH_Number_of_samples_in_this_trace(
+					&in.trace_header) != ns
+					|| !keep_trace(&in, rec_start, rec_end, trace_start,
+							trace_end, trace_offset)) {
+				c->mismatch = true;
+				break;
+			}
+			if (flip_endianess)
+				swap_bytes(p + 240, ns, sl);
+			in.trace_data = p + 240;
+			copy_segy_trace_header(&in, &out);
+			do_change_trace_data(&in, &out);
+			memcpy(out_buf + k * out_trace_len, &out.trace_header, 240);
+			memcpy(out_buf + k * out_trace_len + 240, out.trace_data,
+					out_trace_len - 240);
+		}
+		if (c->mismatch)
+			break;
+		pwrite_all(fileno(out_segy_file.fp), out_buf, m * out_trace_len,
+				out_start + (off_t) j * out_trace_len, out_segy_file.fname);
+		c->traces += m;
+	}
+	free(buf);
+	free(out_buf);
+	free(out.trace_data);
+	free(out.trace_data_double);
+}
+
+/* RETURN: TRUE WHEN THE OUTPUT TRACES HAVE BEEN WRITTEN HERE, FALSE WHEN
+ * THEY MUST BE WRITTEN BY THE MAIN LOOP.
+ */
+bool parallel_convert(SEGY_file *segy_file) {
+	struct stat st, out_st;
+	int ns, j, num_chunks;
+	int out_fd;
+
+	if (!output_segy || in_place || num_threads < 2
+			|| segy_file->fp == stdin || scan || dump || dump_fields
+			|| dump_xy || print_rec_seq_num || export_fields || plot_data
+			|| enable_X11 || qc || build_index || build_key_index
+			|| build_xy_index || verbose >= 2
+			|| skip_nsamples != -1 || only_nsamples != -1
+			|| only_ntraces != -1 || visit_offsets != NULL
+			|| prefetch_slots > 0 || !all_file || only_traces_with
+			|| vertical_stack > 1 || shot_renumber || trace_renumber
+			|| add_xy || add_nav || change_fields || update_fields)
+		return false;
+	if (!is_fixed_sample_format(segy_file)
+			|| !is_fixed_sample_format(&out_segy_file))
+		return false;
+	out_fd = fileno(out_segy_file.fp);
+	ns = GET_SEGYH_Number_of_samples_per_datatrace_for_this_reel(
+			&segy_file->header);
+	off_t start = segy_tell(segy_file);
+	off_t trace_len = 240 + (off_t) ns * trace_sample_length(segy_file);
+	off_t out_trace_len = 240 + (off_t) ns * trace_sample_length(&out_segy_file);
+	if (ns <= 0 || fstat(fileno(segy_file->fp), &st) != 0
+			|| !S_ISREG(st.st_mode) || st.st_size <= start
+			|| (st.st_size - start) % trace_len != 0
+			|| fstat(out_fd, &out_st) != 0 || !S_ISREG(out_st.st_mode))
+		return false;
+
+	/* The SEGY header is already queued, the traces follow it.
+	 */
+	flush_segy_output(&out_segy_file);
+	fflush(out_segy_file.fp);
+	off_t out_start = lseek(out_fd, 0, SEEK_CUR);
+	if (out_start < 0)
+		return false;
+	long num_traces = (st.st_size - start) / trace_len;
+	if (ftruncate(out_fd, out_start + num_traces * out_trace_len) != 0)
+		prerror_and_exit("Error while writing '%s': %s\n",
+				out_segy_file.fname, strerror(errno));
+
+	num_chunks = my_min(num_traces, 8L * num_threads);
+	CONVERT_CHUNK *chunks = (CONVERT_CHUNK *) calloc(num_chunks,
+			sizeof(CONVERT_CHUNK));
+	if (chunks == NULL)
+		prerror_and_exit("Error: Cannot allocate memory for the conversion.\n");
+	for (j = 0; j < num_chunks; j++) {
+		chunks[j].first = num_traces * j / num_chunks;
+		chunks[j].end = num_traces * (j + 1) / num_chunks;
+	}
+
+#pragma omp parallel for schedule(dynamic, 1) num_threads(num_threads)
+	for (j = 0; j < num_chunks; j++)
+		convert_chunk(segy_file, start, ns, out_start, chunks + j);
+
+	/* Drop what has been written, the main loop starts again from the
+	 * first trace.
+	 */
+	for (j = 0; j < num_chunks; j++)
+		if (chunks[j].mismatch) {
+			if (verbose >= 1)
+				fprintf(stderr, "Some traces are not %d samples long or not kept, converting with a single thread.\n", ns);
+			if (ftruncate(out_fd, out_start) != 0)
+				prerror_and_exit("Error while writing '%s': %s\n",
+						out_segy_file.fname, strerror(errno));
+			free(chunks);
+			return false;
+		}
+
+	total_traces += num_traces;
+	processed_traces += num_traces;
+	count += num_traces;
+	free(chunks);
+	return true;
+}
+
 void do_close_files() {
+	stop_prefetch();
+	if (in_place)
+		finish_in_place();
+	if (output_segy && num_threads > 1)
+		flush_worker_traces(); /* The batch may point into the map. */
+	unmap_segy_file(&segy_file);
 	if (segy_file.fp && segy_file.fp != stdin)
 		fclose(segy_file.fp);
+	if (output_segy && out_segy_file.fp)
+		flush_segy_output(&out_segy_file);
 	if (output_segy && out_segy_file.fp && out_segy_file.fp != stdout)
 		fclose(out_segy_file.fp);
 	if (plot_data) {
@@ -3435,6 +7946,8 @@ void DisplayData_Yield(bool exit) {
 #ifndef SEGYCHANGE_LIBRARY
 
 int main(int argc, char **argv) {
+	select_kernels();
+
 	setup();
 
 	read_args(argc, argv);
@@ -3447,6 +7960,8 @@ int main(int argc, char **argv) {
 
 	get_segy_header(&segy_file, verbose);
 
+	advise_header_only(&segy_file);
+
 	do_copy_header();
 
 	do_change_header();
@@ -3455,24 +7970,39 @@ int main(int argc, char **argv) {
 
 	do_skip_ntraces();
 
+	select_traces_by_key(&segy_file);
+
+	select_traces_by_xy(&segy_file);
+
+	select_traces_from_index(&segy_file);
+
+	bool scanned = parallel_scan(&segy_file);
+	bool converted = parallel_convert(&segy_file);
+
+	start_prefetch(&segy_file);
+
 	current_trace = initial_trace_seq;
 	current_record = initial_record - 1;
 
-	while (more_data()) {
+	while (!scanned && !converted && more_data()) {
+		if (visit_offsets != NULL && !prefetch_active
+				&& !seek_next_visit(&segy_file))
+			break;
 		if (get_segy_trace(&segy_file, verbose))
 		{
 			fprintf(stderr,
 					"Error while reading file at byte nr. %ld, record nr. %ld, trace nr. %ld\n",
-					ftell(segy_file.fp),
+					(long) segy_tell(&segy_file),
 					total_records, total_traces);
 			break;
 		}
 		if (!more_data())
 			break;
-		if (!keep_trace(&segy_file, rec_start, rec_end, trace_start, trace_end,
-				trace_offset))
+		if (!segy_file.keep)
 			continue;
 		do_dump_trace();
+		do_export_trace();
+		do_qc_trace();
 		do_change_trace();
 		do_plot_shots();
 		do_write_trace();
@@ -3486,6 +8016,17 @@ int main(int argc, char **argv) {
 #endif
 	}
 
+	if (build_index)
+		write_trace_index(&segy_file);
+	if (build_key_index)
+		write_key_index(&segy_file);
+	if (build_xy_index)
+		write_xy_index(&segy_file);
+
+	finish_dump();
+	finish_export();
+	finish_qc_report();
+
 	do_close_files();
 	if (scan)
 	{